@@ -0,0 +1,239 @@
+#include "common.h"
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+// 静的再コンパイラ (AOT)
+// iNESファイルのリセット、NMI、IRQベクタから到達できる命令をたどり、Cのソースに変換する
+//     ./memu --aot rom/game.nes aot/game.c
+// 出力したファイルをaot/に置いてビルドすると、起動時にPRG-ROMのCRC32をキーとして登録される
+// - 各命令の処理はデコード済みの命令ハンドラ(predecoded_XX)の呼び出しで、サイクル数とバスアクセスはインタプリタと同じ
+// - 命令間の制御はgotoに変換され、分岐先やジャンプ先が静的にわかる場合は直接ジャンプする
+// - RTS/RTI/間接ジャンプの飛び先や、変換していないアドレス(内部RAM、切り替え可能なバンク)はインタプリタで実行する
+
+#define AOT_PROGRAM_MAX (64)
+
+typedef struct {
+    unsigned int crc;
+    unsigned int size;
+    unsigned int (*run)(unsigned int budget);
+} AOT_Program;
+
+extern ROM *rom;
+extern CPU cpu;
+extern unsigned char *read_page[PAGE_COUNT];
+extern Instruction *instruction_table[256];
+
+ROM *load_rom(char *file_name);
+void init_memory_map(void);
+extern void (*init_bank)(void);
+unsigned short read16(unsigned short address);
+void init_instruction_table(void);
+unsigned int prg_window_end(unsigned short pc);
+Instruction *decode_instruction(unsigned short pc, unsigned int bank_end, unsigned short *operand);
+bool may_write_bank(Instruction *i, unsigned short operand);
+unsigned int run_cycles_fast(unsigned int budget);
+
+AOT_Program aot_program[AOT_PROGRAM_MAX];
+int aot_program_count;
+
+// 生成したソースのコンストラクタから呼ばれる
+void register_aot_program(unsigned int crc, unsigned int size, unsigned int (*run)(unsigned int budget)) {
+    if(aot_program_count == AOT_PROGRAM_MAX) {
+        error("Too many AOT programs\n");
+    }
+    aot_program[aot_program_count].crc = crc;
+    aot_program[aot_program_count].size = size;
+    aot_program[aot_program_count].run = run;
+    aot_program_count += 1;
+}
+
+// 読み込み中のROMに対応する変換済みのコードで実行する
+// 見つからない場合はインタプリタで実行する
+ROM *aot_checked_rom;
+
+void flush_aot(void) {
+    aot_checked_rom = NULL;
+}
+
+unsigned int run_cycles_aot(unsigned int budget) {
+    static unsigned int (*run)(unsigned int budget);
+    if(aot_checked_rom != rom) {
+        aot_checked_rom = rom;
+        run = run_cycles_fast;
+        unsigned int crc = crc32(0, rom->program_rom, rom->program_rom_size);
+        for(int i = 0; i < aot_program_count; i++) {
+            if(aot_program[i].crc == crc && aot_program[i].size == rom->program_rom_size) {
+                run = aot_program[i].run;
+            }
+        }
+    }
+    return run(budget);
+}
+
+// 変換
+// 切り替え可能なバンクのコードは実行時の内容がわからないので、変換するのはPRGを切り替えないマッパー0と3なら0x8000以降、それ以外は0xc000以降
+
+bool is_mnemonic(Instruction *i, char *mnemonic) {
+    return strcmp(i->mnemonic, mnemonic) == 0;
+}
+
+bool is_reachable(bool *reachable, unsigned int start, unsigned int address) {
+    return start <= address && address <= 0xffff && reachable[address];
+}
+
+void emit_jump(FILE *fp, bool *reachable, unsigned int start, unsigned int target) {
+    if(is_reachable(reachable, start, target)) {
+        fprintf(fp, "    if(cpu.pc == 0x%04x && CONTINUE) goto L_%04x;\n", target, target);
+    }
+    fprintf(fp, "    goto dispatch;\n");
+}
+
+void recompile(char *rom_file, char *output_file) {
+    rom = load_rom(rom_file);
+    init_memory_map();
+    init_bank();
+    init_instruction_table();
+
+    unsigned int start = (rom->mapper == 0 || rom->mapper == 3) ? 0x8000 : 0xc000;
+    static bool reachable[0x10000];
+    static unsigned short worklist[0x10000];
+    int worklist_count = 0;
+    unsigned short vector[] = {0xfffa, 0xfffc, 0xfffe};
+    for(int i = 0; i < 3; i++) {
+        worklist[worklist_count++] = read16(vector[i]);
+    }
+
+    // 到達できる命令をたどる
+    while(worklist_count > 0) {
+        unsigned short pc = worklist[--worklist_count];
+        while(pc >= start && reachable[pc] == false) {
+            unsigned short operand;
+            Instruction *i = decode_instruction(pc, prg_window_end(pc), &operand);
+            if(i == NULL) {
+                break;
+            }
+            reachable[pc] = true;
+            unsigned int next = pc + i->length;
+            if(i->addressing_mode == REL) {
+                worklist[worklist_count++] = next + (char)operand;
+            } else if(is_mnemonic(i, "JSR")) {
+                worklist[worklist_count++] = operand;
+            } else if(is_mnemonic(i, "JMP")) {
+                if(i->addressing_mode == ABS) {
+                    worklist[worklist_count++] = operand;
+                }
+                break;
+            } else if(is_mnemonic(i, "RTS") || is_mnemonic(i, "RTI")) {
+                break;
+            }
+            if(next > 0xffff) {
+                break;
+            }
+            pc = next;
+        }
+    }
+
+    FILE *fp = fopen(output_file, "w");
+    if(fp == NULL) {
+        error("Cannot open %s\n", output_file);
+    }
+    unsigned int crc = crc32(0, rom->program_rom, rom->program_rom_size);
+    fprintf(fp, "// %s から memu --aot で生成\n", rom_file);
+    fprintf(fp, "#include \"../source/common.h\"\n\n");
+    fprintf(fp, "#define CONTINUE (cpu_cycle < cpu_deadline)\n\n");
+    fprintf(fp, "extern CPU cpu;\n");
+    fprintf(fp, "extern ROM *rom;\n");
+    fprintf(fp, "extern unsigned long long cpu_cycle;\n");
+    fprintf(fp, "extern unsigned long long cpu_deadline;\n");
+    fprintf(fp, "extern unsigned char *read_page[PAGE_COUNT];\n\n");
+    fprintf(fp, "void step_nes(void);\n");
+    fprintf(fp, "unsigned long long begin_run(unsigned int budget);\n");
+    fprintf(fp, "bool continue_run(void);\n");
+    fprintf(fp, "void register_aot_program(unsigned int crc, unsigned int size, unsigned int (*run)(unsigned int budget));\n");
+    bool declared[256] = {false};
+    for(unsigned int pc = start; pc <= 0xffff; pc++) {
+        unsigned short operand;
+        Instruction *i;
+        if(reachable[pc] && (i = decode_instruction(pc, 0x10000, &operand)) != NULL && declared[i->opcode] == false) {
+            fprintf(fp, "bool predecoded_0x%02x(unsigned short operand);\n", i->opcode);
+            declared[i->opcode] = true;
+        }
+    }
+
+    // 変換した範囲のすべてのPRGの窓に変換時と同じバンクが割り当てられている場合だけ変換済みのコードを使う
+    fprintf(fp, "\nstatic unsigned int run(unsigned int budget) {\n");
+    fprintf(fp, "    unsigned long long start_cycle = begin_run(budget);\n");
+    fprintf(fp, "dispatch:\n");
+    fprintf(fp, "    if(CONTINUE == false && continue_run() == false) {\n");
+    fprintf(fp, "        return cpu_cycle - start_cycle;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    if(cpu.pc < 0x%04x", start);
+    for(unsigned int window = start; window <= 0xffff; window += PRG_WINDOW_SIZE) {
+        fprintf(fp, " || read_page[0x%02x] != rom->program_rom + 0x%x", window >> PAGE_SHIFT, (unsigned int)(read_page[window >> PAGE_SHIFT] - rom->program_rom));
+    }
+    fprintf(fp, ") {\n");
+    fprintf(fp, "        step_nes();\n");
+    fprintf(fp, "        goto dispatch;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    switch(cpu.pc) {\n");
+    for(unsigned int pc = start; pc <= 0xffff; pc++) {
+        if(reachable[pc]) {
+            fprintf(fp, "        case 0x%04x: goto L_%04x;\n", pc, pc);
+        }
+    }
+    fprintf(fp, "        default:\n");
+    fprintf(fp, "            step_nes();\n");
+    fprintf(fp, "            goto dispatch;\n");
+    fprintf(fp, "    }\n");
+
+    // 次に出力するラベルが後続の命令ならフォールスルーする
+    unsigned int fallthrough = 0x10000;
+    for(unsigned int pc = start; pc <= 0xffff; pc++) {
+        if(reachable[pc] == false) {
+            continue;
+        }
+        if(fallthrough != 0x10000 && fallthrough != pc) {
+            if(is_reachable(reachable, start, fallthrough)) {
+                fprintf(fp, "    goto L_%04x;\n", fallthrough);
+            } else {
+                fprintf(fp, "    goto dispatch;\n");
+            }
+        }
+        fallthrough = 0x10000;
+        unsigned short operand;
+        Instruction *i = decode_instruction(pc, prg_window_end(pc), &operand);
+        unsigned int next = pc + i->length;
+        fprintf(fp, "L_%04x: // %s\n", pc, i->mnemonic);
+        if(i->addressing_mode == REL) {
+            if(is_reachable(reachable, start, next)) {
+                fprintf(fp, "    if(predecoded_0x%02x(0x%04x)) goto L_%04x;\n", i->opcode, operand, next);
+            } else {
+                fprintf(fp, "    predecoded_0x%02x(0x%04x);\n", i->opcode, operand);
+            }
+            emit_jump(fp, reachable, start, (unsigned short)(next + (char)operand));
+        } else if(i->addressing_mode == ABS && (is_mnemonic(i, "JMP") || is_mnemonic(i, "JSR"))) {
+            fprintf(fp, "    predecoded_0x%02x(0x%04x);\n", i->opcode, operand);
+            emit_jump(fp, reachable, start, operand);
+        } else if(is_mnemonic(i, "JMP") || is_mnemonic(i, "RTS") || is_mnemonic(i, "RTI") || is_mnemonic(i, "BRK")) {
+            fprintf(fp, "    predecoded_0x%02x(0x%04x);\n", i->opcode, operand);
+            fprintf(fp, "    goto dispatch;\n");
+        } else {
+            fprintf(fp, "    if(predecoded_0x%02x(0x%04x) == false) goto dispatch;\n", i->opcode, operand);
+            // マッパーへの書き込みでバンクが切り替わる可能性がある
+            if(may_write_bank(i, operand)) {
+                fprintf(fp, "    goto dispatch;\n");
+            } else {
+                fallthrough = next;
+            }
+        }
+    }
+    if(fallthrough != 0x10000) {
+        fprintf(fp, "    goto dispatch;\n");
+    }
+    fprintf(fp, "}\n\n");
+    fprintf(fp, "__attribute__((constructor)) static void register_program(void) {\n");
+    fprintf(fp, "    register_aot_program(0x%08x, 0x%x, run);\n", crc, rom->program_rom_size);
+    fprintf(fp, "}\n");
+    fclose(fp);
+}
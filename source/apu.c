@@ -3,6 +3,10 @@
 
 #define CPU_HERTZ (1789773.0)
 
+extern unsigned long long cpu_cycle;
+void schedule_event(Event_Type type, unsigned long long cycle, void (*handler)(void));
+void set_irq(unsigned char source, bool active);
+
 typedef struct {
     float duty;
     float volume;
@@ -250,9 +254,73 @@ void write_noise(unsigned short address, unsigned char value) {
     }
 }
 
+// フレームカウンタ (0x4017)
+// ステップごとにEVENT_APU_FRAMEを登録する
+// エンベロープや長さカウンタは未実装なので、4ステップモードの最後のステップで発生するフレーム割り込みだけを扱う
+
+// 各ステップのフレームカウンタ開始からのサイクル数 (最後の要素は1周のサイクル数)
+unsigned int frame_step_cycle[2][6] = {
+    {7457, 14913, 22371, 29829, 29830},
+    {7457, 14913, 22371, 29829, 37281, 37282}
+};
+
+// 0 => 4ステップ, 1 => 5ステップ
+int frame_counter_mode;
+bool frame_irq_inhibit;
+bool frame_irq;
+int frame_step;
+unsigned long long frame_counter_start;
+
+void step_frame_counter(void);
+
+void schedule_frame_counter(void) {
+    schedule_event(EVENT_APU_FRAME, frame_counter_start + frame_step_cycle[frame_counter_mode][frame_step], step_frame_counter);
+}
+
+void step_frame_counter(void) {
+    int step_count = frame_counter_mode == 0 ? 4 : 5;
+    if(frame_counter_mode == 0 && frame_step == 3 && frame_irq_inhibit == false) {
+        frame_irq = true;
+        set_irq(IRQ_APU_FRAME, true);
+    }
+    frame_step += 1;
+    if(frame_step == step_count) {
+        frame_counter_start += frame_step_cycle[frame_counter_mode][step_count];
+        frame_step = 0;
+    }
+    schedule_frame_counter();
+}
+
+void write_frame_counter(unsigned char value) {
+    frame_counter_mode = (value >> 7) & 0x01;
+    frame_irq_inhibit = (value >> 6) & 0x01;
+    if(frame_irq_inhibit) {
+        frame_irq = false;
+        set_irq(IRQ_APU_FRAME, false);
+    }
+    frame_step = 0;
+    frame_counter_start = cpu_cycle;
+    schedule_frame_counter();
+}
+
+// 0x4015 (Read)
+// ビット6のフレーム割り込みだけを返し、読み込むとクリアされる
+unsigned char read_apu_status(void) {
+    unsigned char value = frame_irq ? 0x40 : 0x00;
+    frame_irq = false;
+    set_irq(IRQ_APU_FRAME, false);
+    return value;
+}
+
 void init_apu(void) {
     init_channel1();
     init_channel2();
     init_channel3();
     init_channel4();
+    frame_counter_mode = 0;
+    frame_irq_inhibit = false;
+    frame_irq = false;
+    frame_step = 0;
+    frame_counter_start = cpu_cycle;
+    schedule_frame_counter();
 }
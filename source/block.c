@@ -0,0 +1,310 @@
+#include "common.h"
+#include <string.h>
+
+// デコード済みブロックのキャッシュ
+// PRG-ROM上の命令列を、分岐などでブロックが終わるまで(ハンドラ, オペランド)の配列に変換して保持する (サイクル数は各ハンドラが進める)
+// ループ本体は命令のフェッチやデコードをせずに配列から直接実行される
+// - キーはPCとその時点のPCのページの割り当てで、マッパーがバンクを切り替えると古いバンクのブロックは使われない
+// - 内部RAM上のコードは書き換えられる可能性があるのでキャッシュせず、インタプリタで実行する
+// - 副作用のない待機ループ(アイドルループ)は、次にPPUの状態が変化する直前まで繰り返しを省略する (特殊化ディスパッチからも使う)
+
+#define BLOCK_MAX_INSTRUCTION (64)
+#define DECODED_POOL_SIZE (0x10000)
+#define IDLE_LOOP_MAX_INSTRUCTION (8)
+
+extern CPU cpu;
+extern unsigned long long cpu_cycle;
+extern unsigned long long cpu_deadline;
+extern unsigned long long next_event_cycle;
+extern unsigned int instruction_count;
+extern Instruction *instruction_table[256];
+extern bool (*predecoded_handler[256])(unsigned short operand);
+extern unsigned char *read_page[PAGE_COUNT];
+
+unsigned char read8(unsigned short address);
+unsigned short read16(unsigned short address);
+void step_nes(void);
+void tick(unsigned int cycle);
+unsigned char peek_ppu_status(void);
+unsigned long long begin_run(unsigned int budget);
+bool continue_run(void);
+bool (*find_superinstruction(unsigned char first, unsigned short first_operand, unsigned char second, unsigned short second_operand, unsigned short *operand))(unsigned short);
+
+typedef struct {
+    unsigned char *bank;
+    Decoded_Instruction *run;
+    unsigned short length;
+    // ブロック自身へ戻る分岐で終わり、メモリへの書き込みがないループ
+    bool idle_candidate;
+    // 先頭の命令がデコードできない場合はtrue (同じバンクの間はデコードし直さない)
+    bool uncacheable;
+} Block_Cache_Entry;
+
+Block_Cache_Entry block_cache[0x8000];
+Decoded_Instruction decoded_pool[DECODED_POOL_SIZE];
+unsigned int decoded_pool_used;
+// アイドルループで省略したサイクル数
+unsigned long long idle_skipped_cycles;
+
+// 分岐やジャンプなど、次の命令へ進まない可能性があるものはブロックの最後にする
+bool is_block_end(Instruction *i) {
+    static char *mnemonic[] = {"JMP", "JSR", "RTS", "RTI", "BRK"};
+    if(i->addressing_mode == REL) {
+        return true;
+    }
+    for(int index = 0; index < sizeof(mnemonic) / sizeof(char*); index++) {
+        if(strcmp(i->mnemonic, mnemonic[index]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 0x8000以降に書き込む可能性がある命令はバンク切り替えの可能性があるので、ブロックの最後にする
+bool may_write_bank(Instruction *i, unsigned short operand) {
+    static char *mnemonic[] = {"STA", "STX", "STY", "*SAX", "ASL", "LSR", "ROL", "ROR", "INC", "DEC", "*DCP", "*ISB", "*RLA", "*RRA", "*SLO", "*SRE"};
+    bool write = false;
+    for(int index = 0; index < sizeof(mnemonic) / sizeof(char*); index++) {
+        if(strcmp(i->mnemonic, mnemonic[index]) == 0) {
+            write = true;
+        }
+    }
+    switch(i->addressing_mode) {
+        case ACC: case ZPG: case ZPX: case ZPY:
+            return false;
+        case ABS:
+            return write && operand >= 0x8000;
+        case ABX: case ABY:
+            return write && operand + 0xff >= 0x8000;
+        default:
+            return write;
+    }
+}
+
+// pcを含むPRGの窓の終わり
+unsigned int prg_window_end(unsigned short pc) {
+    return (pc & ~(PRG_WINDOW_SIZE - 1)) + PRG_WINDOW_SIZE;
+}
+
+// pcの命令とそのオペランドを読み込む
+// 不正な命令か、命令がbank_endをまたぐ場合はNULLを返す
+Instruction *decode_instruction(unsigned short pc, unsigned int bank_end, unsigned short *operand) {
+    Instruction *i = instruction_table[read8(pc)];
+    if(i == NULL || pc + i->length > bank_end) {
+        return NULL;
+    }
+    *operand = 0;
+    if(i->length == 2) {
+        *operand = read8(pc + 1);
+    } else if(i->length == 3) {
+        *operand = read16(pc + 1);
+    }
+    return i;
+}
+
+// pcから始まるブロックをrunにデコードし、エントリ数を返す (jit.cと共通)
+// ブロックはPRGの窓の境界をまたがない
+// fuseがtrueの場合、スーパー命令にできる2命令の組は1つのエントリにまとめる
+int decode_block(unsigned short pc, Decoded_Instruction *run, int max, bool fuse) {
+    unsigned int bank_end = prg_window_end(pc);
+    int length = 0;
+    while(length < max) {
+        unsigned short operand;
+        Instruction *i = decode_instruction(pc, bank_end, &operand);
+        if(i == NULL) {
+            break;
+        }
+        run[length].handler = predecoded_handler[i->opcode];
+        run[length].operand = operand;
+        pc += i->length;
+        if(fuse && is_block_end(i) == false && may_write_bank(i, operand) == false && pc != bank_end) {
+            unsigned short next_operand;
+            Instruction *next = decode_instruction(pc, bank_end, &next_operand);
+            bool (*handler)(unsigned short) = NULL;
+            if(next != NULL) {
+                handler = find_superinstruction(i->opcode, operand, next->opcode, next_operand, &run[length].operand);
+            }
+            if(handler != NULL) {
+                run[length].handler = handler;
+                i = next;
+                operand = next_operand;
+                pc += i->length;
+            }
+        }
+        length += 1;
+        if(is_block_end(i) || may_write_bank(i, operand) || pc == bank_end) {
+            break;
+        }
+    }
+    return length;
+}
+
+// アイドルループの中で使える命令か
+// メモリを書き換えず、読み込みに副作用がない(内部RAM、PRG-ROM、0x2002のみ)ものに限る
+bool is_idle_instruction(Instruction *i, unsigned short operand) {
+    static char *mnemonic[] = {"LDA", "LDX", "LDY", "BIT", "CMP", "CPX", "CPY", "AND", "ORA", "EOR", "TAX", "TAY", "TXA", "TYA", "NOP"};
+    bool found = false;
+    for(int index = 0; index < sizeof(mnemonic) / sizeof(char*); index++) {
+        if(strcmp(i->mnemonic, mnemonic[index]) == 0) {
+            found = true;
+        }
+    }
+    if(found == false) {
+        return false;
+    }
+    switch(i->addressing_mode) {
+        case IMP: case IMM: case ZPG: case ZPX: case ZPY:
+            return true;
+        case ABS:
+            return operand < 0x2000 || operand == 0x2002 || operand >= 0x8000;
+        case ABX: case ABY:
+            return operand + 0xff < 0x2000 || operand >= 0x8000;
+        default:
+            return false;
+    }
+}
+
+// pcから始まるブロックがアイドルループの候補なら、ループの命令数(最後の分岐命令を含む)を返す
+// 候補でない場合は0
+unsigned int idle_loop_length(unsigned short pc) {
+    unsigned int bank_end = prg_window_end(pc);
+    unsigned short start = pc;
+    for(int count = 0; count < IDLE_LOOP_MAX_INSTRUCTION; count++) {
+        unsigned short operand;
+        Instruction *i = decode_instruction(pc, bank_end, &operand);
+        if(i == NULL) {
+            return 0;
+        }
+        pc += i->length;
+        if(i->addressing_mode == REL) {
+            return (unsigned short)(pc + (char)operand) == start ? count + 1 : 0;
+        } else if(is_idle_instruction(i, operand) == false) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// 1回の繰り返しでCPUの状態とPPUのステータスが変わらなかった場合、以降の繰り返しも同じ結果になる
+// 次のイベント(PPUの状態の変化、フレームカウンタなど)の直前までの繰り返しをtick()だけで進める
+void skip_idle_loop(unsigned int iteration_cycle) {
+    unsigned long long limit = next_event_cycle < cpu_deadline ? next_event_cycle : cpu_deadline;
+    if(limit <= cpu_cycle) {
+        return;
+    }
+    unsigned long long cycle = (limit - cpu_cycle - 1) / iteration_cycle * iteration_cycle;
+    idle_skipped_cycles += cycle;
+    tick(cycle);
+}
+
+bool is_same_state(CPU *a, CPU *b) {
+    return a->a == b->a && a->x == b->x && a->y == b->y && a->s == b->s && a->pc == b->pc &&
+           a->p.z_result == b->p.z_result && a->p.n_result == b->p.n_result && a->p.id == b->p.id &&
+           a->p.overflow_result == b->p.overflow_result && a->p.carry_result == b->p.carry_result;
+}
+
+// 特殊化ディスパッチ(run_cycles_fast)のアイドルループ
+// 後方への分岐で戻ってきた時に、前回同じ分岐先に戻ってきた時からちょうど1回ループを実行しただけで
+// CPUの状態とPPUのステータスが変わっていなければ、skip_idle_loopで残りの繰り返しを省略する
+// (間に割り込みが入った場合は命令数がループの命令数と合わないので省略しない)
+typedef struct {
+    unsigned char *bank;
+    // アイドルループの命令数 (候補でない場合は0)
+    unsigned char length;
+    bool checked;
+} Idle_Loop_Entry;
+
+Idle_Loop_Entry idle_loop_table[0x8000];
+unsigned short watched_pc;
+CPU watched_state;
+unsigned char watched_status;
+unsigned long long watched_cycle;
+unsigned int watched_instruction_count;
+
+// 後方への分岐を実行した直後に呼ぶ
+void watch_idle_loop(void) {
+    if(cpu.pc < 0x8000) {
+        return;
+    }
+    Idle_Loop_Entry *entry = idle_loop_table + (cpu.pc - 0x8000);
+    unsigned char *bank = read_page[cpu.pc >> PAGE_SHIFT];
+    if(entry->bank != bank || entry->checked == false) {
+        entry->bank = bank;
+        entry->length = idle_loop_length(cpu.pc);
+        entry->checked = true;
+    }
+    if(entry->length == 0) {
+        return;
+    }
+    unsigned char status = peek_ppu_status();
+    if(watched_pc == cpu.pc && instruction_count - watched_instruction_count == entry->length &&
+       cpu_cycle < cpu_deadline && is_same_state(&watched_state, &cpu) && watched_status == status) {
+        skip_idle_loop(cpu_cycle - watched_cycle);
+    }
+    watched_pc = cpu.pc;
+    watched_state = cpu;
+    watched_status = status;
+    watched_cycle = cpu_cycle;
+    watched_instruction_count = instruction_count;
+}
+
+void flush_block_cache(void) {
+    memset(block_cache, 0, sizeof(block_cache));
+    decoded_pool_used = 0;
+    memset(idle_loop_table, 0, sizeof(idle_loop_table));
+    watched_pc = 0;
+}
+
+// キャッシュしたブロックを実行してtrueを返す
+// キャッシュできない場合はfalseを返し、呼び出し側がインタプリタで1命令実行する
+bool run_cached_block(void) {
+    if(cpu.pc < 0x8000) {
+        return false;
+    }
+    Block_Cache_Entry *entry = block_cache + (cpu.pc - 0x8000);
+    unsigned char *bank = read_page[cpu.pc >> PAGE_SHIFT];
+    if(entry->bank == bank && entry->uncacheable) {
+        return false;
+    }
+    if(entry->bank != bank || entry->run == NULL) {
+        if(DECODED_POOL_SIZE - decoded_pool_used < BLOCK_MAX_INSTRUCTION) {
+            flush_block_cache();
+        }
+        entry->bank = bank;
+        entry->run = decoded_pool + decoded_pool_used;
+        // アイドルループは1回の繰り返しを観測できるように、スーパー命令にしない
+        entry->idle_candidate = idle_loop_length(cpu.pc) > 0;
+        entry->length = decode_block(cpu.pc, entry->run, BLOCK_MAX_INSTRUCTION, entry->idle_candidate == false);
+        decoded_pool_used += entry->length;
+        entry->uncacheable = entry->length == 0;
+        if(entry->uncacheable) {
+            entry->run = NULL;
+            return false;
+        }
+    }
+    Decoded_Instruction *d = entry->run;
+    Decoded_Instruction *end = d + entry->length;
+    if(entry->idle_candidate) {
+        CPU state = cpu;
+        unsigned char status = peek_ppu_status();
+        unsigned long long start_cycle = cpu_cycle;
+        while(d->handler(d->operand) && ++d < end);
+        if(cpu_cycle < cpu_deadline && is_same_state(&state, &cpu) && status == peek_ppu_status()) {
+            skip_idle_loop(cpu_cycle - start_cycle);
+        }
+        return true;
+    }
+    while(d->handler(d->operand) && ++d < end);
+    return true;
+}
+
+// run_cyclesと同じ条件で停止する
+unsigned int run_cycles_cached(unsigned int budget) {
+    unsigned long long start_cycle = begin_run(budget);
+    while(cpu_cycle < cpu_deadline || continue_run()) {
+        if(run_cached_block() == false) {
+            step_nes();
+        }
+    }
+    return cpu_cycle - start_cycle;
+}
@@ -1,13 +1,23 @@
 #include "common.h"
+#include <stdio.h>
 
 #define between(start, address, end) (start <= address && address <= end)
 
+// PPUを命令ごとに進めず、PPUのレジスタへのアクセスかEVENT_PPU(NMI、スプライトゼロヒット、フレーム終了)の時点でまとめて進める
+// #define LAZY_PPU
+
 ROM *rom;
 unsigned char internal_ram[0x800];
 
-extern unsigned int cpu_cycle;
+extern unsigned long long cpu_cycle;
+extern unsigned long long next_event_cycle;
+void init_event(void);
+void run_events(void);
+void schedule_event(Event_Type type, unsigned long long cycle, void (*handler)(void));
 ROM *load_rom(char *file_name);
+void free_rom(ROM *rom);
 void tick_ppu(unsigned int cycle);
+unsigned int ppu_cycles_to_next_event(void);
 void init_ppu(void);
 void init_apu(void);
 void write_ppu_control(unsigned char value);
@@ -16,6 +26,7 @@ unsigned char read_ppu_status(void);
 void write_oam_address(unsigned char value);
 unsigned char read_oam_data(void);
 void write_oam_data(unsigned char value);
+void write_oam_dma(unsigned char *data);
 void write_ppu_scroll(unsigned char value);
 void write_ppu_address(unsigned char value);
 unsigned char read_ppu_data(void);
@@ -26,68 +37,118 @@ void write_square1(unsigned short address, unsigned char value);
 void write_square2(unsigned short address, unsigned char value);
 void write_triangle(unsigned short address, unsigned char value);
 void write_noise(unsigned short address, unsigned char value);
+unsigned char read_apu_status(void);
+void write_frame_counter(unsigned char value);
+unsigned char bus_read8(unsigned short address);
 
 extern void (*init_bank)(void);
-extern unsigned char (*read_bank1)(unsigned short address);
-extern unsigned char (*read_bank2)(unsigned short address);
 extern void (*write_bank)(unsigned short address, unsigned char value);
 
+// ページテーブル
+// read_page/write_pageがNULLでないページはホストのメモリを直接読み書きし、NULLのページはハンドラを呼ぶ
+// 内部RAMは0x0000-0x1fffの8ページに2KBを繰り返し割り当て、PRG-ROMはマッパーがmap_prgで割り当てる
+unsigned char *read_page[PAGE_COUNT];
+unsigned char *write_page[PAGE_COUNT];
+unsigned char (*read_handler[PAGE_COUNT])(unsigned short address);
+void (*write_handler[PAGE_COUNT])(unsigned short address, unsigned char value);
+
+// まだ実行していないPPUサイクル数 (LAZY_PPU)
+unsigned int ppu_pending_cycle;
+
+// 溜まっているPPUサイクルを実行する
+void sync_ppu(void) {
+    if(ppu_pending_cycle > 0) {
+        tick_ppu(ppu_pending_cycle);
+        ppu_pending_cycle = 0;
+    }
+}
+
+// CPUから見えるPPUの状態が次に変化する時刻にEVENT_PPUを登録する
+// 変化はppu_cycles_to_next_event後のPPUサイクルを含むtick()で処理される
+void schedule_ppu_event(void) {
+    sync_ppu();
+    schedule_event(EVENT_PPU, cpu_cycle + (ppu_cycles_to_next_event() + 2) / 3, schedule_ppu_event);
+}
+
 void tick(unsigned int cycle) {
     cpu_cycle += cycle;
+#ifdef LAZY_PPU
+    ppu_pending_cycle += cycle * 3;
+#else
     tick_ppu(cycle * 3);
+#endif
+    if(cpu_cycle >= next_event_cycle) {
+        run_events();
+    }
 }
 
-void init_bus(char *file_name) {
-    rom = load_rom(file_name);
-    init_bank();
-    init_ppu();
-    init_apu();
+// 0x2000-0x3fff (8バイトごとに繰り返す)
+unsigned char read_ppu_register(unsigned short address) {
+    sync_ppu();
+    switch(address & 0x07) {
+        case 2:
+            return read_ppu_status();
+        case 4:
+            return read_oam_data();
+        case 7:
+            return read_ppu_data();
+        default:
+            error("Unsupported bus read 0x%04X\n", address);
+            return 0;
+    }
 }
 
-unsigned char bus_read8(unsigned short address) {
-    if(between(0x0000, address, 0x1fff)) {
-        return internal_ram[address & 0x7ff];
-    } else if(address == 0x2002) {
-        return read_ppu_status();
-    } else if(address == 0x2004) {
-        return read_oam_data();
-    } else if(address == 0x2007) {
-        return read_ppu_data();
-    } else if(between(0x2008, address, 0x3fff)) {
-        return bus_read8(address & 0x2007);
+void write_ppu_register(unsigned short address, unsigned char value) {
+    sync_ppu();
+    switch(address & 0x07) {
+        case 0:
+            write_ppu_control(value);
+            // スプライトの大きさでスプライトオーバーフローの時刻が変わる
+            schedule_ppu_event();
+            break;
+        case 1:
+            write_ppu_mask(value);
+            // 描画の有効化でスプライトゼロヒットの時刻が変わる
+            schedule_ppu_event();
+            break;
+        case 2:
+            error("Unsupported bus write 0x%04X\n", address);
+            break;
+        case 3:
+            write_oam_address(value);
+            break;
+        case 4:
+            write_oam_data(value);
+            schedule_ppu_event();
+            break;
+        case 5:
+            write_ppu_scroll(value);
+            break;
+        case 6:
+            write_ppu_address(value);
+            break;
+        case 7:
+            write_ppu_data(value);
+            break;
+    }
+}
+
+// 0x4000-0x43ff
+unsigned char read_io_register(unsigned short address) {
+    if(address == 0x4015) {
+        return read_apu_status();
     } else if(address == 0x4016) {
         return read_joypad();
-    } else if(between(0x8000, address, 0xbfff)) {
-        return read_bank1(address);
-    } else if(between(0xc000, address, 0xffff)) {
-        return read_bank2(address);
     } else if(address == 0x4017) {
         return 0;
     } else {
         error("Unsupported bus read 0x%04X\n", address);
+        return 0;
     }
 }
 
-void bus_write8(unsigned short address, unsigned char value) {
-    if(between(0x0000, address, 0x1fff)) {
-        internal_ram[address & 0x7ff] = value;
-    } else if(address == 0x2000) {
-        write_ppu_control(value);
-    } else if(address == 0x2001) {
-        write_ppu_mask(value);
-    } else if(address == 0x2003) {
-        write_oam_address(value);
-    } else if(address == 0x2004) {
-        write_oam_data(value);
-    } else if(address == 0x2005) {
-        write_ppu_scroll(value);
-    } else if(address == 0x2006) {
-        write_ppu_address(value);
-    } else if(address == 0x2007) {
-        write_ppu_data(value);
-    } else if(between(0x2008, address, 0x3fff)) {
-        bus_write8(address & 0x2007, value);
-    } else if(between(0x4000, address, 0x4003)) {
+void write_io_register(unsigned short address, unsigned char value) {
+    if(between(0x4000, address, 0x4003)) {
         write_square1(address, value);
     } else if(between(0x4004, address, 0x4007)) {
         write_square2(address, value);
@@ -96,18 +157,109 @@ void bus_write8(unsigned short address, unsigned char value) {
     } else if(between(0x400c, address, 0x400f)) {
         write_noise(address, value);
     } else if(address == 0x4014) {
+        sync_ppu();
         tick((cpu_cycle % 2 == 0) ? 1 : 2);
-        for(int i = 0; i < 256; i++) {
-            write_oam_data(bus_read8((value << 8) + i));
-            tick(2);
+        unsigned char *page = read_page[(value << 8) >> PAGE_SHIFT];
+        if(page != NULL) {
+            // 転送元が内部RAMかPRG-ROMなら読み込みに副作用がないので、まとめてコピーしてから512サイクルを1回で進める
+            // 転送中に時刻に達したイベントは、tick()の最後にまとめて処理される
+            sync_ppu();
+            write_oam_dma(page + ((value << 8) & (PAGE_SIZE - 1)));
+            schedule_ppu_event();
+            tick(512);
+        } else {
+            for(int i = 0; i < 256; i++) {
+                unsigned char data = bus_read8((value << 8) + i);
+                sync_ppu();
+                write_oam_data(data);
+                tick(2);
+            }
         }
+        schedule_ppu_event();
     } else if(address == 0x4016) {
         write_joypad(value);
-    } else if(between(0x8000, address, 0xffff)) {
-        write_bank(address, value);
-    } else if(address == 0x4010 || address == 0x4011 || address == 0x4015 || address == 0x4017) {
+    } else if(address == 0x4017) {
+        write_frame_counter(value);
+    } else if(address == 0x4010 || address == 0x4011 || address == 0x4015) {
 
     } else {
         error("Unsupported bus write 0x%04X\n", address);
     }
 }
+
+unsigned char read_unmapped(unsigned short address) {
+    error("Unsupported bus read 0x%04X\n", address);
+    return 0;
+}
+
+void write_unmapped(unsigned short address, unsigned char value) {
+    error("Unsupported bus write 0x%04X\n", address);
+}
+
+// PRG-ROMへの書き込みはマッパーのレジスタへの書き込み
+void write_mapper(unsigned short address, unsigned char value) {
+    sync_ppu();
+    write_bank(address, value);
+}
+
+// addressからsizeバイトをbankに割り当てる (マッパーがバンクを切り替える時に呼ぶ)
+void map_prg(unsigned short address, unsigned char *bank, unsigned int size) {
+    for(unsigned int i = 0; i < (size >> PAGE_SHIFT); i++) {
+        read_page[(address >> PAGE_SHIFT) + i] = bank + (i << PAGE_SHIFT);
+    }
+}
+
+void init_memory_map(void) {
+    for(int i = 0; i < PAGE_COUNT; i++) {
+        read_page[i] = write_page[i] = NULL;
+        read_handler[i] = read_unmapped;
+        write_handler[i] = write_unmapped;
+    }
+    for(int i = 0x0000 >> PAGE_SHIFT; i < 0x2000 >> PAGE_SHIFT; i++) {
+        read_page[i] = write_page[i] = internal_ram + ((i << PAGE_SHIFT) & 0x7ff);
+    }
+    for(int i = 0x2000 >> PAGE_SHIFT; i < 0x4000 >> PAGE_SHIFT; i++) {
+        read_handler[i] = read_ppu_register;
+        write_handler[i] = write_ppu_register;
+    }
+    read_handler[0x4000 >> PAGE_SHIFT] = read_io_register;
+    write_handler[0x4000 >> PAGE_SHIFT] = write_io_register;
+    for(int i = 0x6000 >> PAGE_SHIFT; i < 0x8000 >> PAGE_SHIFT; i++) {
+        read_page[i] = write_page[i] = rom->program_ram + ((i << PAGE_SHIFT) & 0x1fff);
+    }
+    for(int i = 0x8000 >> PAGE_SHIFT; i < PAGE_COUNT; i++) {
+        write_handler[i] = write_mapper;
+    }
+}
+
+void init_bus(char *file_name) {
+    init_event();
+    if(rom != NULL) {
+        free_rom(rom);
+    }
+    rom = load_rom(file_name);
+    init_memory_map();
+    // PPUのページテーブルの初期値(CHRの先頭8KB、ヘッダのミラーリング)をマッパーが変更できるように先に初期化する
+    init_ppu();
+    init_bank();
+    init_apu();
+    ppu_pending_cycle = 0;
+    schedule_ppu_event();
+}
+
+unsigned char bus_read8(unsigned short address) {
+    unsigned char *page = read_page[address >> PAGE_SHIFT];
+    if(page != NULL) {
+        return page[address & (PAGE_SIZE - 1)];
+    }
+    return read_handler[address >> PAGE_SHIFT](address);
+}
+
+void bus_write8(unsigned short address, unsigned char value) {
+    unsigned char *page = write_page[address >> PAGE_SHIFT];
+    if(page != NULL) {
+        page[address & (PAGE_SIZE - 1)] = value;
+        return;
+    }
+    write_handler[address >> PAGE_SHIFT](address, value);
+}
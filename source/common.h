@@ -11,16 +11,144 @@
 #define SCREEN_PIXEL_HEIGHT (BLOCK_PIXEL_SIZE * SCREEN_BLOCK_HEIGHT)
 
 typedef struct {
+    // ファイル全体 (読み込み専用のマッピング)
     unsigned char *rom;
+    unsigned int rom_size;
     unsigned char *program_rom;
     unsigned int program_rom_size;
+    // CHR-RAMの場合はCHR-RAM
     unsigned char *character_rom;
     unsigned int character_rom_size;
     bool has_character_ram;
+    unsigned int character_ram_size;
+    unsigned char *program_ram;
+    unsigned int program_ram_size;
+    bool has_battery;
+    // program_ramが.savファイルのマッピング
+    bool has_save_file;
     unsigned int mirroring;
     unsigned int mapper;
+    unsigned int submapper;
 } ROM;
 
+// rom.cのヘッダを修正するデータベースの1行
+typedef struct {
+    unsigned int crc;
+    unsigned int mapper;
+    unsigned int mirroring;
+    bool has_battery;
+    // データベースの何番目の行か (同じCRC32の行は最初の行を使う)
+    int line;
+} Header_Correction;
+
+// CRC32の順に並べたデータベース
+typedef struct {
+    Header_Correction *entry;
+    int count;
+} Header_Database;
+
+// library.cの索引の1ファイル
+typedef struct {
+    char *path;
+    // 更新日時 (ナノ秒)
+    long long mtime;
+    long long size;
+    // PRG-ROMとCHR-ROMのCRC32
+    unsigned int crc;
+    unsigned int mapper;
+    unsigned int submapper;
+    unsigned int mirroring;
+    unsigned int program_rom_size;
+    unsigned int character_rom_size;
+    bool has_battery;
+    // ヘッダが正しく、マッパーに対応している
+    bool valid;
+    // 索引を作り直す必要がある (走査中のみ)
+    bool stale;
+} Library_Entry;
+
+typedef enum {
+    IMP, ACC, IMM, ZPG, ZPX, ZPY, ABS, ABX, ABY, IND, INX, INY, REL
+} Addressing_Mode;
+
+typedef enum {
+    None, Page, Branch
+} Cycle_Mode;
+
+typedef struct {
+    unsigned char opcode;
+    char *mnemonic;
+    void (*function)(void);
+    Addressing_Mode addressing_mode;
+    unsigned short length;
+    unsigned int cycle;
+    Cycle_Mode cycle_mode;
+} Instruction;
+
+// フラグは演算結果をそのまま保持し、分岐やPHP、割り込みで必要になった時にだけ計算する
+// z_resultとn_resultを隣接させると、update_znの2つの書き込みが上位バイトレジスタ経由の
+// 16ビット書き込みにまとめられて遅くなるため、間にidを挟んでいる
+typedef struct {
+    // Z = (z_result == 0)
+    unsigned char z_result;
+    // Iフラグ(0x04)とDフラグ(0x08)をPレジスタと同じビット位置で保持する
+    unsigned char id;
+    // N = n_resultのビット7
+    unsigned char n_result;
+    // V = overflow_resultのビット7
+    unsigned char overflow_result;
+    // C = carry_resultのビット8 (ADCなどは9ビットの結果をそのまま保存する)
+    unsigned int carry_result;
+} Flag;
+
+typedef struct {
+    unsigned char a, x, y, s;
+    unsigned short pc;
+    Flag p;
+    unsigned short address;
+    unsigned int extra_cycle;
+    Cycle_Mode cycle_mode;
+} CPU;
+
+// デコード済みの命令 (block.c, jit.c)
+typedef struct {
+    bool (*handler)(unsigned short operand);
+    unsigned short operand;
+} Decoded_Instruction;
+
+// CPUのメモリマップは1KBのページ単位でbus.cのページテーブルに割り当てる
+#define PAGE_SHIFT (10)
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_COUNT (0x10000 >> PAGE_SHIFT)
+// マッパーがPRG-ROMを切り替える最小の単位 (block.c、jit.c、aot.cが変換したコードはこの窓をまたがない)
+#define PRG_WINDOW_SIZE (0x2000)
+// PPUのメモリマップ(0x0000-0x3fff)も同じ大きさのページでppu.cのページテーブルに割り当てる
+#define PPU_PAGE_COUNT (0x4000 >> PAGE_SHIFT)
+
+// ネームテーブルのミラーリング (ROM.mirroring、set_mirroring)
+#define MIRROR_HORIZONTAL (0)
+#define MIRROR_VERTICAL (1)
+#define MIRROR_FOUR_SCREEN (2)
+#define MIRROR_SINGLE_LOW (3)
+#define MIRROR_SINGLE_HIGH (4)
+
+// tile.cで展開したタイル (通常と水平反転のそれぞれ)
+typedef struct {
+    // y * 8 + xのピクセルの色番号 (0-3)
+    unsigned char pixel[64];
+    // 行ごとの不透明なピクセル (ビットxがx番目のピクセル)
+    unsigned char opaque[8];
+} Decoded_Tile;
+
+// event.cで管理するイベントの種類
+typedef enum {
+    EVENT_PPU, EVENT_APU_FRAME, EVENT_MAPPER, EVENT_COUNT
+} Event_Type;
+
+// IRQ線を保持する割り込み元 (いずれかがセットされている間、Iフラグが0ならIRQを受け付ける)
+#define IRQ_APU_FRAME (0x01)
+#define IRQ_MAPPER (0x02)
+
 void error(char *message, ...);
 
 #endif
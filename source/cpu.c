@@ -1,80 +1,121 @@
 #include "common.h"
 #include <gtk-3.0/gtk/gtk.h>
 #include <stdbool.h>
+#include <limits.h>
 
 // #define NESTEST
-
-unsigned int cpu_cycle;
+// 1命令ごとにGTKのメインループへ戻る従来の実行方式 (命令/秒の比較用)
+// #define SINGLE_STEP
+// instruction_tableと関数ポインタを経由する従来の命令ディスパッチ (特殊化ディスパッチとの比較用)
+// #define TABLE_DISPATCH
+// PRG-ROM上のよく実行されるブロックをx86-64のコードに変換して実行する (jit.c)
+// #define JIT
+// PRG-ROM上のブロックをデコード済みの配列としてキャッシュして実行する (block.c)
+// #define BLOCK_CACHE
+// memu --aotで変換したaot/*.cのコードで実行する (aot.c、対応するROMがなければ特殊化ディスパッチ)
+// #define AOT
+// スーパー命令ごとの実行回数を終了時に表示する (TABLE_DISPATCHと、AOTで変換したコードの実行中は数えない)
+// #define SUPERINSTRUCTION_PROFILE
+// ROMごとにアイドルループで省略したサイクル数をROMの切り替え時と終了時に表示する
+// アイドルループを省略するのは特殊化ディスパッチとBLOCK_CACHEのみ (SINGLE_STEP、TABLE_DISPATCH、JIT、AOTで変換したコードは省略しない)
+// #define IDLE_LOOP_STATS
+
+// 64ビットのマスタークロック (CPUサイクル単位、event.cのイベントの時刻もこれで表す)
+unsigned long long cpu_cycle;
+// 実行中のrun_cycles系の関数が終了するサイクル
+unsigned long long run_end_cycle;
+// 各コアはcpu_cycleがcpu_deadlineに達するまで、割り込みやフレーム終了を確認せずに命令を実行する
+// 割り込みの要求やフレーム終了でcpu_deadlineは0になり、次の命令境界でcontinue_runが呼ばれる
+unsigned long long cpu_deadline;
+bool nmi_pending;
+// IRQ_APU_FRAME, IRQ_MAPPER
+unsigned char irq_source;
+// show_fpsで1秒ごとに表示してリセットする実行命令数
+unsigned int instruction_count;
 extern unsigned int ppu_cycle, scanline;
+extern unsigned char internal_ram[0x800];
+extern bool frame_ready;
+extern unsigned long long idle_skipped_cycles;
 
-typedef enum {
-    IMP, ACC, IMM, ZPG, ZPX, ZPY, ABS, ABX, ABY, IND, INX, INY, REL
-} Addressing_Mode;
-
-typedef enum {
-    None, Page, Branch
-} Cycle_Mode;
-
-typedef struct {
-    unsigned char opcode;
-    char *mnemonic;
-    void (*function)(void);
-    Addressing_Mode addressing_mode;
-    unsigned short length;
-    unsigned int cycle;
-    Cycle_Mode cycle_mode;
-} Instruction;
+// 統計表示用の読み込み中のROMと、読み込み時のサイクル数
+char *rom_file_name;
+unsigned long long rom_start_cycle;
 
 Instruction instruction[227];
 Instruction *instruction_table[256];
 
-typedef struct {
-    bool c;
-    bool z;
-    bool i;
-    bool d;
-    bool v;
-    bool n;
-} Flag;
-
-typedef struct {
-    unsigned char a, x, y, s;
-    unsigned short pc;
-    Flag p;
-    unsigned short address;
-    unsigned int extra_cycle;
-    Cycle_Mode cycle_mode;
-} CPU;
-
 CPU cpu;
 
 void tick(unsigned int cycle);
+void sync_ppu(void);
 void init_bus(char *file_name);
-unsigned char bus_read8(unsigned short address);
-void bus_write8(unsigned short address, unsigned char value);
+void flush_block_cache(void);
+void flush_jit(void);
+void flush_aot(void);
+void sync_save_file(void);
+void wait_next_frame(void);
+extern unsigned char *read_page[PAGE_COUNT];
+extern unsigned char *write_page[PAGE_COUNT];
+extern unsigned char (*read_handler[PAGE_COUNT])(unsigned short address);
+extern void (*write_handler[PAGE_COUNT])(unsigned short address, unsigned char value);
+void print_superinstruction_count(void);
+void watch_idle_loop(void);
+void print_stats(void);
+void nmi(void);
+void irq(void);
+
+#define FLAG_C ((cpu.p.carry_result >> 8) & 0x01)
+#define FLAG_Z (cpu.p.z_result == 0)
+#define FLAG_V ((cpu.p.overflow_result >> 7) & 0x01)
+#define FLAG_N ((cpu.p.n_result >> 7) & 0x01)
+
+// 次の命令境界でcontinue_runを呼ばせる
+void interrupt_run(void) {
+    cpu_deadline = 0;
+}
+
+void raise_nmi(void) {
+    nmi_pending = true;
+    cpu_deadline = 0;
+}
+
+// IRQ線の状態を変える
+void set_irq(unsigned char source, bool active) {
+    if(active) {
+        irq_source |= source;
+        cpu_deadline = 0;
+    } else {
+        irq_source &= ~source;
+    }
+}
+
+// CLI/PLP/RTIでIフラグが0になった時、IRQ線がセットされていれば次の命令境界で受け付ける
+static inline void check_irq(void) {
+    if(irq_source != 0 && (cpu.p.id & 0x04) == 0) {
+        cpu_deadline = 0;
+    }
+}
 
 void set_flag(unsigned char value) {
-    cpu.p.c = (value & 0x01) != 0;
-    cpu.p.z = (value & 0x02) != 0;
-    cpu.p.i = (value & 0x04) != 0;
-    cpu.p.d = (value & 0x08) != 0;
-    cpu.p.v = (value & 0x40) != 0;
-    cpu.p.n = (value & 0x80) != 0;
+    cpu.p.id = value & 0x0c;
+    cpu.p.z_result = ~value & 0x02;
+    cpu.p.n_result = value & 0x80;
+    cpu.p.carry_result = (value & 0x01) << 8;
+    cpu.p.overflow_result = (value & 0x40) << 1;
+    check_irq();
 }
 
 unsigned char get_flag(void) {
-    unsigned char value = 0x20;
-    if(cpu.p.c) value |= 0x01;
-    if(cpu.p.z) value |= 0x02;
-    if(cpu.p.i) value |= 0x04;
-    if(cpu.p.d) value |= 0x08;
-    if(cpu.p.v) value |= 0x40;
-    if(cpu.p.n) value |= 0x80;
-    return value;
+    return 0x20 | cpu.p.id | FLAG_C | (FLAG_Z << 1) | (FLAG_V << 6) | (FLAG_N << 7);
 }
 
+// 内部RAMとPRG-ROMはページテーブルから直接アクセスし、それ以外はページのハンドラを呼ぶ (bus_read8/bus_write8と同じ)
 unsigned char read8(unsigned short address) {
-    return bus_read8(address);
+    unsigned char *page = read_page[address >> PAGE_SHIFT];
+    if(page != NULL) {
+        return page[address & (PAGE_SIZE - 1)];
+    }
+    return read_handler[address >> PAGE_SHIFT](address);
 }
 
 unsigned short read16(unsigned short address) {
@@ -89,12 +130,32 @@ unsigned short bug_read16(unsigned short address) {
     }
 }
 
+// ゼロページ上のポインタ読み込み (0xffの次は0x00に戻る)
+unsigned short zero_page_read16(unsigned char address) {
+    return internal_ram[address] + (internal_ram[(unsigned char)(address + 1)] << 8);
+}
+
 void write8(unsigned short address, unsigned char value) {
-    bus_write8(address, value);
+    unsigned char *page = write_page[address >> PAGE_SHIFT];
+    if(page != NULL) {
+        page[address & (PAGE_SIZE - 1)] = value;
+        return;
+    }
+    write_handler[address >> PAGE_SHIFT](address, value);
+}
+
+// 読み込み-変更-書き込み命令は、結果の前に元の値をもう一度書き込む (MMC1はこの2回目の書き込みを無視する)
+// ページテーブルに割り当てられたメモリは結果だけ書き込めば同じなので省く
+void write_modified8(unsigned short address, unsigned char original, unsigned char value) {
+    if(write_page[address >> PAGE_SHIFT] == NULL) {
+        write_handler[address >> PAGE_SHIFT](address, original);
+    }
+    write8(address, value);
 }
 
+// スタックは常に内部RAMの0x0100-0x01ffにある
 void push8(unsigned char value) {
-    write8(0x100 + cpu.s--, value);
+    internal_ram[0x100 + cpu.s--] = value;
 }
 
 void push16(unsigned short value) {
@@ -103,7 +164,7 @@ void push16(unsigned short value) {
 }
 
 unsigned char pop8(void) {
-    return read8(0x100 + ++cpu.s);
+    return internal_ram[0x100 + ++cpu.s];
 }
 
 unsigned short pop16(void) {
@@ -111,54 +172,72 @@ unsigned short pop16(void) {
     return value + (pop8() << 8);
 }
 
-unsigned short get_address(Addressing_Mode addressing_mode) {
+// オペランドはアドレッシングモードが必要とするバイトだけを読み込む
+// (I/Oレジスタに隣接する命令で余計なバスアクセスによる副作用を起こさないため)
+static inline unsigned short fetch_operand(Addressing_Mode addressing_mode) {
+    switch(addressing_mode) {
+        case ZPG:
+        case ZPX:
+        case ZPY:
+        case INX:
+        case INY:
+        case REL:
+            return read8(cpu.pc + 1);
+        case ABS:
+        case ABX:
+        case ABY:
+        case IND:
+            return read16(cpu.pc + 1);
+        default:
+            return 0;
+    }
+}
+
+// 読み込み済みのオペランドから実効アドレスを求める (デコード済みの命令ハンドラと共通)
+static inline unsigned short resolve_address(Addressing_Mode addressing_mode, unsigned short operand) {
     unsigned short address = cpu.pc + 1;
-    unsigned char argument8 = read8(address);
-    unsigned short argument16 = read16(address);
     switch(addressing_mode) {
         case IMP:
         case ACC:
         case IMM:
             break;
         case ZPG:
-            address = argument8;
+        case ABS:
+            address = operand;
             break;
         case ZPX:
-            address = (unsigned char)(argument8 + cpu.x);
+            address = (unsigned char)(operand + cpu.x);
             break;
         case ZPY:
-            address = (unsigned char)(argument8 + cpu.y);
-            break;
-        case ABS:
-            address = argument16;
+            address = (unsigned char)(operand + cpu.y);
             break;
         case ABX:
-            address = argument16 + cpu.x;
-            if(cpu.cycle_mode == Page && (argument16 & 0xff00) != (address & 0xff00)) {
+            address = operand + cpu.x;
+            if(cpu.cycle_mode == Page && (operand & 0xff00) != (address & 0xff00)) {
                 cpu.extra_cycle += 1;
             }
             break;
         case ABY:
-            address = argument16 + cpu.y;
-            if(cpu.cycle_mode == Page && (argument16 & 0xff00) != (address & 0xff00)) {
+            address = operand + cpu.y;
+            if(cpu.cycle_mode == Page && (operand & 0xff00) != (address & 0xff00)) {
                 cpu.extra_cycle += 1;
             }
             break;
         case IND:
-            address = bug_read16(argument16);
+            address = bug_read16(operand);
             break;
         case INX:
-            address = bug_read16((unsigned char)(argument8 + cpu.x));
+            address = zero_page_read16(operand + cpu.x);
             break;
         case INY:
-            unsigned short address2 = bug_read16(argument8);
-            address = address2 + cpu.y;
-            if(cpu.cycle_mode == Page && (address2 & 0xff00) != (address & 0xff00)) {
+            operand = zero_page_read16(operand);
+            address = operand + cpu.y;
+            if(cpu.cycle_mode == Page && (operand & 0xff00) != (address & 0xff00)) {
                 cpu.extra_cycle += 1;
             }
             break;
         case REL:
-            address = (char)argument8;
+            address = (char)operand;
             break;
         default:
             error("Unknown addressing mode\n");
@@ -166,6 +245,11 @@ unsigned short get_address(Addressing_Mode addressing_mode) {
     return address;
 }
 
+// 特殊化ディスパッチではaddressing_modeが定数になるので、インライン展開されてswitchが消える
+static inline unsigned short get_address(Addressing_Mode addressing_mode) {
+    return resolve_address(addressing_mode, fetch_operand(addressing_mode));
+}
+
 void _log(Instruction *i) {
     static int count;
     static FILE *fp;
@@ -189,7 +273,11 @@ void _log(Instruction *i) {
     fprintf(fp, "%*s", 3 * (3 - i->length), "");
 
     char s[256];
-    unsigned char value = read8(cpu.address);
+    // 値を表示するアドレッシングモードでのみ読み込む
+    unsigned char value = 0;
+    if(i->addressing_mode != IMP && i->addressing_mode != ACC && i->addressing_mode != IND && i->addressing_mode != REL && i->mnemonic[0] != 'J') {
+        value = read8(cpu.address);
+    }
     switch(i->addressing_mode) {
         case IMP:
             s[0] = '\0';
@@ -229,7 +317,7 @@ void _log(Instruction *i) {
             sprintf(s, "($%02X,X) @ %02X = %04X = %02X", data[1], (unsigned char)(data[1] + cpu.x), cpu.address, value);
             break;
         case INY:
-            sprintf(s, "($%02X),Y = %04X @ %04X = %02X", data[1], bug_read16(data[1]), cpu.address, value);
+            sprintf(s, "($%02X),Y = %04X @ %04X = %02X", data[1], zero_page_read16(data[1]), cpu.address, value);
             break;
         case REL:
             sprintf(s, "$%04X", (unsigned short)(cpu.pc + 2 + cpu.address));
@@ -238,21 +326,69 @@ void _log(Instruction *i) {
             error("Unknown addressing mode\n");
     }
     fprintf(fp, "%4s %-28s", i->mnemonic, s);
-    fprintf(fp, "A:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3d,%3d CYC:%d\n", cpu.a, cpu.x, cpu.y, get_flag(), cpu.s, scanline, ppu_cycle, cpu_cycle);
+    // LAZY_PPUの場合はPPUの位置を表示する前に追いつく
+    sync_ppu();
+    fprintf(fp, "A:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3d,%3d CYC:%llu\n", cpu.a, cpu.x, cpu.y, get_flag(), cpu.s, scanline, ppu_cycle, cpu_cycle);
+}
+
+void init_instruction_table(void) {
+    for(int i = 0; i < sizeof(instruction) / sizeof(Instruction); i++) {
+        instruction_table[instruction[i].opcode] = instruction + i;
+    }
+}
+
+void print_idle_loop_stats(void) {
+    if(rom_file_name != NULL) {
+        unsigned long long total = cpu_cycle - rom_start_cycle;
+        fprintf(stderr, "%s: %llu / %llu cycles skipped in idle loops (%.1f%%)\n", rom_file_name, idle_skipped_cycles, total, total ? 100.0 * idle_skipped_cycles / total : 0.0);
+#if defined(SINGLE_STEP) || defined(TABLE_DISPATCH) || defined(JIT)
+        fprintf(stderr, "%s: this CPU core does not skip idle loops\n", rom_file_name);
+#elif defined(AOT) && !defined(BLOCK_CACHE)
+        fprintf(stderr, "%s: idle loops are not skipped while running AOT-compiled code\n", rom_file_name);
+#endif
+    }
+}
+
+void print_stats(void) {
+#ifdef SUPERINSTRUCTION_PROFILE
+    print_superinstruction_count();
+#endif
+#ifdef IDLE_LOOP_STATS
+    print_idle_loop_stats();
+#endif
 }
 
 void init_nes(char *file_name) {
+#ifdef IDLE_LOOP_STATS
+    print_idle_loop_stats();
+#endif
+    rom_file_name = file_name;
+    rom_start_cycle = cpu_cycle;
+    idle_skipped_cycles = 0;
+    nmi_pending = false;
+    irq_source = 0;
+    run_end_cycle = ULLONG_MAX;
+    cpu_deadline = 0;
+    // 前のROMのメモリが再利用されても古い変換結果を使わないように破棄する
+    flush_block_cache();
+    flush_jit();
+    flush_aot();
     init_bus(file_name);
     cpu.a = cpu.x = cpu.y = 0;
     cpu.s = 0xfd;
     cpu.pc = read16(0xfffc);
     set_flag(0x04);
-    for(int i = 0; i < sizeof(instruction) / sizeof(Instruction); i++) {
-        instruction_table[instruction[i].opcode] = instruction + i;
+    init_instruction_table();
+#if defined(SUPERINSTRUCTION_PROFILE) || defined(IDLE_LOOP_STATS)
+    static bool registered;
+    if(registered == false) {
+        atexit(print_stats);
+        registered = true;
     }
+#endif
 }
 
-gboolean run_nes(gpointer data) {
+void step_nes(void) {
     Instruction *i = instruction_table[read8(cpu.pc)];
     if(i == NULL) {
         error("Invalid opcode 0x%02X\n", read8(cpu.pc));
@@ -266,21 +402,90 @@ gboolean run_nes(gpointer data) {
     i->function();
     cpu.pc += i->length;
     tick(i->cycle + cpu.extra_cycle);
+    instruction_count += 1;
+}
+
+// run_cycles系の関数の開始時に呼び、開始時のサイクルを返す
+// 保留中の割り込みを最初の命令の前に受け付けるため、cpu_deadlineを0にしておく
+unsigned long long begin_run(unsigned int budget) {
+    frame_ready = false;
+    run_end_cycle = cpu_cycle + budget;
+    cpu_deadline = 0;
+    return cpu_cycle;
+}
+
+// cpu_deadlineに達した命令境界で呼ぶ
+// 保留中の割り込みを受け付け、予算を使い切るかVBLANKに到達していればfalseを返す
+bool continue_run(void) {
+    cpu_deadline = run_end_cycle;
+    if(nmi_pending) {
+        nmi_pending = false;
+        nmi();
+    } else if(irq_source != 0 && (cpu.p.id & 0x04) == 0) {
+        irq();
+    }
+    return frame_ready == false && cpu_cycle < run_end_cycle;
+}
+
+// 指定したサイクル数を使い切るか、VBLANK(241行目)に到達するまで命令を実行する
+// 実際に消費したサイクル数を返す
+unsigned int run_cycles(unsigned int budget) {
+    unsigned long long start_cycle = begin_run(budget);
+    while(cpu_cycle < cpu_deadline || continue_run()) {
+        step_nes();
+    }
+    return cpu_cycle - start_cycle;
+}
+
+unsigned int run_cycles_fast(unsigned int budget);
+unsigned int run_cycles_jit(unsigned int budget);
+unsigned int run_cycles_cached(unsigned int budget);
+unsigned int run_cycles_aot(unsigned int budget);
+
+// 1フレーム分(次のVBLANKまで)をまとめて実行する
+void run_frame(void) {
+#if defined(TABLE_DISPATCH)
+    run_cycles(UINT_MAX);
+#elif defined(JIT)
+    run_cycles_jit(UINT_MAX);
+#elif defined(BLOCK_CACHE)
+    run_cycles_cached(UINT_MAX);
+#elif defined(AOT)
+    run_cycles_aot(UINT_MAX);
+#else
+    run_cycles_fast(UINT_MAX);
+#endif
+    sync_save_file();
+}
+
+gboolean run_nes(gpointer data) {
+#ifdef SINGLE_STEP
+    if(cpu_cycle >= cpu_deadline) {
+        continue_run();
+    }
+    step_nes();
+    if(frame_ready) {
+        frame_ready = false;
+        wait_next_frame();
+    }
+#else
+    run_frame();
+    wait_next_frame();
+#endif
     return G_SOURCE_CONTINUE;
 }
 
 void update_zn(unsigned char value) {
-    cpu.p.z = value == 0;
-    cpu.p.n = (value & 0x80) != 0;
+    cpu.p.z_result = cpu.p.n_result = value;
 }
 
 void adc(void) {
     unsigned char a = cpu.a;
     unsigned char m = read8(cpu.address);
-    unsigned short r = a + m + cpu.p.c;
+    unsigned short r = a + m + FLAG_C;
     cpu.a = r;
-    cpu.p.c = r > 0xff;
-    cpu.p.v = ((a ^ r) & (m ^ r) & 0x80) != 0;
+    cpu.p.carry_result = r;
+    cpu.p.overflow_result = (a ^ r) & (m ^ r);
     update_zn(cpu.a);
 }
 
@@ -290,19 +495,20 @@ void and(void) {
 }
 
 void asl_acc(void) {
-    cpu.p.c = (cpu.a & 0x80) != 0;
+    cpu.p.carry_result = cpu.a << 1;
     cpu.a <<= 1;
     update_zn(cpu.a);
 }
 
 void asl(void) {
     unsigned char m = read8(cpu.address);
-    cpu.p.c = (m & 0x80) != 0;
-    write8(cpu.address, m << 1);
+    cpu.p.carry_result = m << 1;
+    write_modified8(cpu.address, m, m << 1);
     update_zn(m << 1);
 }
 
-void branch(bool condition) {
+// 分岐条件はフラグの遅延計算と一緒に展開されるようにインライン化する
+static inline __attribute__((always_inline)) void branch(bool condition) {
     if(condition) {
         cpu.extra_cycle += 1;
         if(((cpu.pc + 2) & 0xff00) != ((cpu.pc + 2 + cpu.address) & 0xff00)) {
@@ -313,70 +519,71 @@ void branch(bool condition) {
 }
 
 void bcc(void) {
-    branch(cpu.p.c == false);
+    branch(FLAG_C == 0);
 }
 
 void bcs(void) {
-    branch(cpu.p.c == true);
+    branch(FLAG_C == 1);
 }
 
 void beq(void) {
-    branch(cpu.p.z == true);
+    branch(FLAG_Z == 1);
 }
 
 void bit(void) {
     unsigned char m = read8(cpu.address);
-    cpu.p.z = (cpu.a & m) == 0;
-    cpu.p.v = (m & 0x40) != 0;
-    cpu.p.n = (m & 0x80) != 0;
+    cpu.p.z_result = cpu.a & m;
+    cpu.p.overflow_result = m << 1;
+    cpu.p.n_result = m;
 }
 
 void bmi(void) {
-    branch(cpu.p.n == true);
+    branch(FLAG_N == 1);
 }
 
 void bne(void) {
-    branch(cpu.p.z == false);
+    branch(FLAG_Z == 0);
 }
 
 void bpl(void) {
-    branch(cpu.p.n == false);
+    branch(FLAG_N == 0);
 }
 
 void _brk(void) {
     push16(cpu.pc + 2);
     push8(get_flag() | 0x10);
     cpu.pc = read16(0xfffe) - 1;
-    cpu.p.i = true;
+    cpu.p.id |= 0x04;
 }
 
 void bvc(void) {
-    branch(cpu.p.v == false);
+    branch(FLAG_V == 0);
 }
 
 void bvs(void) {
-    branch(cpu.p.v == true);
+    branch(FLAG_V == 1);
 }
 
 void clc(void) {
-    cpu.p.c = false;
+    cpu.p.carry_result = 0;
 }
 
 void cld(void) {
-    cpu.p.d = false;
+    cpu.p.id &= ~0x08;
 }
 
 void cli(void) {
-    cpu.p.i = false;
+    cpu.p.id &= ~0x04;
+    check_irq();
 }
 
 void clv(void) {
-    cpu.p.v = false;
+    cpu.p.overflow_result = 0;
 }
 
 void compare(unsigned char r) {
     unsigned char m = read8(cpu.address);
-    cpu.p.c = r >= m;
+    cpu.p.carry_result = r + (m ^ 0xff) + 1;
     update_zn(r - m);
 }
 
@@ -394,7 +601,7 @@ void cpy(void) {
 
 void dec(void) {
     unsigned char m = read8(cpu.address);
-    write8(cpu.address, m - 1);
+    write_modified8(cpu.address, m, m - 1);
     update_zn(m - 1);
 }
 
@@ -415,7 +622,7 @@ void eor(void) {
 
 void inc(void) {
     unsigned char m = read8(cpu.address);
-    write8(cpu.address, m + 1);
+    write_modified8(cpu.address, m, m + 1);
     update_zn(m + 1);
 }
 
@@ -454,15 +661,15 @@ void ldy(void) {
 }
 
 void lsr_acc(void) {
-    cpu.p.c = (cpu.a & 0x01) != 0;
+    cpu.p.carry_result = (cpu.a & 0x01) << 8;
     cpu.a >>= 1;
     update_zn(cpu.a);
 }
 
 void lsr(void) {
     unsigned char m = read8(cpu.address);
-    cpu.p.c = (m & 0x01) != 0;
-    write8(cpu.address, m >> 1);
+    cpu.p.carry_result = (m & 0x01) << 8;
+    write_modified8(cpu.address, m, m >> 1);
     update_zn(m >> 1);
 }
 
@@ -493,33 +700,32 @@ void plp(void) {
 }
 
 void rol_acc(void) {
-    unsigned char c = (cpu.a & 0x80) != 0;
-    cpu.a = (cpu.a << 1) + cpu.p.c;
-    cpu.p.c = c;
+    cpu.p.carry_result = (cpu.a << 1) + FLAG_C;
+    cpu.a = cpu.p.carry_result;
     update_zn(cpu.a);
 }
 
 void rol(void) {
     unsigned char m = read8(cpu.address);
-    unsigned char c = (m & 0x80) != 0;
-    write8(cpu.address, (m << 1) + cpu.p.c);
-    update_zn((m << 1) + cpu.p.c);
-    cpu.p.c = c;
+    unsigned short r = (m << 1) + FLAG_C;
+    write_modified8(cpu.address, m, r);
+    update_zn(r);
+    cpu.p.carry_result = r;
 }
 
 void ror_acc(void) {
-    unsigned char c = (cpu.a & 0x01) != 0;
-    cpu.a = (cpu.a >> 1) + (cpu.p.c << 7);
-    cpu.p.c = c;
+    unsigned char c = cpu.a & 0x01;
+    cpu.a = (cpu.a >> 1) + (FLAG_C << 7);
+    cpu.p.carry_result = c << 8;
     update_zn(cpu.a);
 }
 
 void ror(void) {
     unsigned char m = read8(cpu.address);
-    unsigned char c = (m & 0x01) != 0;
-    write8(cpu.address, (m >> 1) + (cpu.p.c << 7));
-    update_zn((m >> 1) + (cpu.p.c << 7));
-    cpu.p.c = c;
+    unsigned char r = (m >> 1) + (FLAG_C << 7);
+    write_modified8(cpu.address, m, r);
+    update_zn(r);
+    cpu.p.carry_result = (m & 0x01) << 8;
 }
 
 void rti(void) {
@@ -534,23 +740,24 @@ void rts(void) {
 void sbc(void) {
     unsigned char a = cpu.a;
     unsigned char m = read8(cpu.address);
-    unsigned short r = a - m - !cpu.p.c;
+    // a - m - !c = a + ~m + c として、ADCと同じ形でキャリーを求める
+    unsigned short r = a + (m ^ 0xff) + FLAG_C;
     cpu.a = r;
-    cpu.p.c = r <= 0xff;
-    cpu.p.v = ((a ^ m) & (a ^ r) & 0x80) != 0;
+    cpu.p.carry_result = r;
+    cpu.p.overflow_result = (a ^ m) & (a ^ r);
     update_zn(cpu.a);
 }
 
 void sec(void) {
-    cpu.p.c = true;
+    cpu.p.carry_result = 0x100;
 }
 
 void sed(void) {
-    cpu.p.d = true;
+    cpu.p.id |= 0x08;
 }
 
 void sei(void) {
-    cpu.p.i = true;
+    cpu.p.id |= 0x04;
 }
 
 void sta(void) {
@@ -633,260 +840,513 @@ void sre(void) {
     eor();
 }
 
+// 命令定義の一覧 (instruction[]と特殊化した命令ハンドラの両方をここから生成する)
+// X(opcode, mnemonic, function, addressing_mode, length, cycle, cycle_mode)
+#define INSTRUCTION_LIST(X) \
+    X(0x69, "ADC",  adc,     IMM, 2, 2, None  ) \
+    X(0x65, "ADC",  adc,     ZPG, 2, 3, None  ) \
+    X(0x75, "ADC",  adc,     ZPX, 2, 4, None  ) \
+    X(0x6d, "ADC",  adc,     ABS, 3, 4, None  ) \
+    X(0x7d, "ADC",  adc,     ABX, 3, 4, Page  ) \
+    X(0x79, "ADC",  adc,     ABY, 3, 4, Page  ) \
+    X(0x61, "ADC",  adc,     INX, 2, 6, None  ) \
+    X(0x71, "ADC",  adc,     INY, 2, 5, Page  ) \
+    X(0x29, "AND",  and,     IMM, 2, 2, None  ) \
+    X(0x25, "AND",  and,     ZPG, 2, 3, None  ) \
+    X(0x35, "AND",  and,     ZPX, 2, 4, None  ) \
+    X(0x2d, "AND",  and,     ABS, 3, 4, None  ) \
+    X(0x3d, "AND",  and,     ABX, 3, 4, Page  ) \
+    X(0x39, "AND",  and,     ABY, 3, 4, Page  ) \
+    X(0x21, "AND",  and,     INX, 2, 6, None  ) \
+    X(0x31, "AND",  and,     INY, 2, 5, Page  ) \
+    X(0x0a, "ASL",  asl_acc, ACC, 1, 2, None  ) \
+    X(0x06, "ASL",  asl,     ZPG, 2, 5, None  ) \
+    X(0x16, "ASL",  asl,     ZPX, 2, 6, None  ) \
+    X(0x0e, "ASL",  asl,     ABS, 3, 6, None  ) \
+    X(0x1e, "ASL",  asl,     ABX, 3, 7, None  ) \
+    X(0x90, "BCC",  bcc,     REL, 2, 2, Branch) \
+    X(0xb0, "BCS",  bcs,     REL, 2, 2, Branch) \
+    X(0xf0, "BEQ",  beq,     REL, 2, 2, Branch) \
+    X(0x24, "BIT",  bit,     ZPG, 2, 3, None  ) \
+    X(0x2c, "BIT",  bit,     ABS, 3, 4, None  ) \
+    X(0x30, "BMI",  bmi,     REL, 2, 2, Branch) \
+    X(0xd0, "BNE",  bne,     REL, 2, 2, Branch) \
+    X(0x10, "BPL",  bpl,     REL, 2, 2, Branch) \
+    X(0x00, "BRK",  _brk,    IMP, 1, 7, None  ) \
+    X(0x50, "BVC",  bvc,     REL, 2, 2, Branch) \
+    X(0x70, "BVS",  bvs,     REL, 2, 2, Branch) \
+    X(0x18, "CLC",  clc,     IMP, 1, 2, None  ) \
+    X(0xd8, "CLD",  cld,     IMP, 1, 2, None  ) \
+    X(0x58, "CLI",  cli,     IMP, 1, 2, None  ) \
+    X(0xb8, "CLV",  clv,     IMP, 1, 2, None  ) \
+    X(0xc9, "CMP",  cmp,     IMM, 2, 2, None  ) \
+    X(0xc5, "CMP",  cmp,     ZPG, 2, 3, None  ) \
+    X(0xd5, "CMP",  cmp,     ZPX, 2, 4, None  ) \
+    X(0xcd, "CMP",  cmp,     ABS, 3, 4, None  ) \
+    X(0xdd, "CMP",  cmp,     ABX, 3, 4, Page  ) \
+    X(0xd9, "CMP",  cmp,     ABY, 3, 4, Page  ) \
+    X(0xc1, "CMP",  cmp,     INX, 2, 6, None  ) \
+    X(0xd1, "CMP",  cmp,     INY, 2, 5, Page  ) \
+    X(0xe0, "CPX",  cpx,     IMM, 2, 2, None  ) \
+    X(0xe4, "CPX",  cpx,     ZPG, 2, 3, None  ) \
+    X(0xec, "CPX",  cpx,     ABS, 3, 4, None  ) \
+    X(0xc0, "CPY",  cpy,     IMM, 2, 2, None  ) \
+    X(0xc4, "CPY",  cpy,     ZPG, 2, 3, None  ) \
+    X(0xcc, "CPY",  cpy,     ABS, 3, 4, None  ) \
+    X(0xc6, "DEC",  dec,     ZPG, 2, 5, None  ) \
+    X(0xd6, "DEC",  dec,     ZPX, 2, 6, None  ) \
+    X(0xce, "DEC",  dec,     ABS, 3, 6, None  ) \
+    X(0xde, "DEC",  dec,     ABX, 3, 7, None  ) \
+    X(0xca, "DEX",  dex,     IMP, 1, 2, None  ) \
+    X(0x88, "DEY",  dey,     IMP, 1, 2, None  ) \
+    X(0x49, "EOR",  eor,     IMM, 2, 2, None  ) \
+    X(0x45, "EOR",  eor,     ZPG, 2, 3, None  ) \
+    X(0x55, "EOR",  eor,     ZPX, 2, 4, None  ) \
+    X(0x4d, "EOR",  eor,     ABS, 3, 4, None  ) \
+    X(0x5d, "EOR",  eor,     ABX, 3, 4, Page  ) \
+    X(0x59, "EOR",  eor,     ABY, 3, 4, Page  ) \
+    X(0x41, "EOR",  eor,     INX, 2, 6, None  ) \
+    X(0x51, "EOR",  eor,     INY, 2, 5, Page  ) \
+    X(0xe6, "INC",  inc,     ZPG, 2, 5, None  ) \
+    X(0xf6, "INC",  inc,     ZPX, 2, 6, None  ) \
+    X(0xee, "INC",  inc,     ABS, 3, 6, None  ) \
+    X(0xfe, "INC",  inc,     ABX, 3, 7, None  ) \
+    X(0xe8, "INX",  inx,     IMP, 1, 2, None  ) \
+    X(0xc8, "INY",  iny,     IMP, 1, 2, None  ) \
+    X(0x4c, "JMP",  jmp,     ABS, 3, 3, None  ) \
+    X(0x6c, "JMP",  jmp,     IND, 3, 5, None  ) \
+    X(0x20, "JSR",  jsr,     ABS, 3, 6, None  ) \
+    X(0xa9, "LDA",  lda,     IMM, 2, 2, None  ) \
+    X(0xa5, "LDA",  lda,     ZPG, 2, 3, None  ) \
+    X(0xb5, "LDA",  lda,     ZPX, 2, 4, None  ) \
+    X(0xad, "LDA",  lda,     ABS, 3, 4, None  ) \
+    X(0xbd, "LDA",  lda,     ABX, 3, 4, Page  ) \
+    X(0xb9, "LDA",  lda,     ABY, 3, 4, Page  ) \
+    X(0xa1, "LDA",  lda,     INX, 2, 6, None  ) \
+    X(0xb1, "LDA",  lda,     INY, 2, 5, Page  ) \
+    X(0xa2, "LDX",  ldx,     IMM, 2, 2, None  ) \
+    X(0xa6, "LDX",  ldx,     ZPG, 2, 3, None  ) \
+    X(0xb6, "LDX",  ldx,     ZPY, 2, 4, None  ) \
+    X(0xae, "LDX",  ldx,     ABS, 3, 4, None  ) \
+    X(0xbe, "LDX",  ldx,     ABY, 3, 4, Page  ) \
+    X(0xa0, "LDY",  ldy,     IMM, 2, 2, None  ) \
+    X(0xa4, "LDY",  ldy,     ZPG, 2, 3, None  ) \
+    X(0xb4, "LDY",  ldy,     ZPX, 2, 4, None  ) \
+    X(0xac, "LDY",  ldy,     ABS, 3, 4, None  ) \
+    X(0xbc, "LDY",  ldy,     ABX, 3, 4, Page  ) \
+    X(0x4a, "LSR",  lsr_acc, ACC, 1, 2, None  ) \
+    X(0x46, "LSR",  lsr,     ZPG, 2, 5, None  ) \
+    X(0x56, "LSR",  lsr,     ZPX, 2, 6, None  ) \
+    X(0x4e, "LSR",  lsr,     ABS, 3, 6, None  ) \
+    X(0x5e, "LSR",  lsr,     ABX, 3, 7, None  ) \
+    X(0xea, "NOP",  nop,     IMP, 1, 2, None  ) \
+    X(0x09, "ORA",  ora,     IMM, 2, 2, None  ) \
+    X(0x05, "ORA",  ora,     ZPG, 2, 3, None  ) \
+    X(0x15, "ORA",  ora,     ZPX, 2, 4, None  ) \
+    X(0x0d, "ORA",  ora,     ABS, 3, 4, None  ) \
+    X(0x1d, "ORA",  ora,     ABX, 3, 4, Page  ) \
+    X(0x19, "ORA",  ora,     ABY, 3, 4, Page  ) \
+    X(0x01, "ORA",  ora,     INX, 2, 6, None  ) \
+    X(0x11, "ORA",  ora,     INY, 2, 5, Page  ) \
+    X(0x48, "PHA",  pha,     IMP, 1, 3, None  ) \
+    X(0x08, "PHP",  php,     IMP, 1, 3, None  ) \
+    X(0x68, "PLA",  pla,     IMP, 1, 4, None  ) \
+    X(0x28, "PLP",  plp,     IMP, 1, 4, None  ) \
+    X(0x2a, "ROL",  rol_acc, ACC, 1, 2, None  ) \
+    X(0x26, "ROL",  rol,     ZPG, 2, 5, None  ) \
+    X(0x36, "ROL",  rol,     ZPX, 2, 6, None  ) \
+    X(0x2e, "ROL",  rol,     ABS, 3, 6, None  ) \
+    X(0x3e, "ROL",  rol,     ABX, 3, 7, None  ) \
+    X(0x6a, "ROR",  ror_acc, ACC, 1, 2, None  ) \
+    X(0x66, "ROR",  ror,     ZPG, 2, 5, None  ) \
+    X(0x76, "ROR",  ror,     ZPX, 2, 6, None  ) \
+    X(0x6e, "ROR",  ror,     ABS, 3, 6, None  ) \
+    X(0x7e, "ROR",  ror,     ABX, 3, 7, None  ) \
+    X(0x40, "RTI",  rti,     IMP, 1, 6, None  ) \
+    X(0x60, "RTS",  rts,     IMP, 1, 6, None  ) \
+    X(0xe9, "SBC",  sbc,     IMM, 2, 2, None  ) \
+    X(0xe5, "SBC",  sbc,     ZPG, 2, 3, None  ) \
+    X(0xf5, "SBC",  sbc,     ZPX, 2, 4, None  ) \
+    X(0xed, "SBC",  sbc,     ABS, 3, 4, None  ) \
+    X(0xfd, "SBC",  sbc,     ABX, 3, 4, Page  ) \
+    X(0xf9, "SBC",  sbc,     ABY, 3, 4, Page  ) \
+    X(0xe1, "SBC",  sbc,     INX, 2, 6, None  ) \
+    X(0xf1, "SBC",  sbc,     INY, 2, 5, Page  ) \
+    X(0x38, "SEC",  sec,     IMP, 1, 2, None  ) \
+    X(0xf8, "SED",  sed,     IMP, 1, 2, None  ) \
+    X(0x78, "SEI",  sei,     IMP, 1, 2, None  ) \
+    X(0x85, "STA",  sta,     ZPG, 2, 3, None  ) \
+    X(0x95, "STA",  sta,     ZPX, 2, 4, None  ) \
+    X(0x8d, "STA",  sta,     ABS, 3, 4, None  ) \
+    X(0x9d, "STA",  sta,     ABX, 3, 5, None  ) \
+    X(0x99, "STA",  sta,     ABY, 3, 5, None  ) \
+    X(0x81, "STA",  sta,     INX, 2, 6, None  ) \
+    X(0x91, "STA",  sta,     INY, 2, 6, None  ) \
+    X(0x86, "STX",  stx,     ZPG, 2, 3, None  ) \
+    X(0x96, "STX",  stx,     ZPY, 2, 4, None  ) \
+    X(0x8e, "STX",  stx,     ABS, 3, 4, None  ) \
+    X(0x84, "STY",  sty,     ZPG, 2, 3, None  ) \
+    X(0x94, "STY",  sty,     ZPX, 2, 4, None  ) \
+    X(0x8c, "STY",  sty,     ABS, 3, 4, None  ) \
+    X(0xaa, "TAX",  tax,     IMP, 1, 2, None  ) \
+    X(0xa8, "TAY",  tay,     IMP, 1, 2, None  ) \
+    X(0xba, "TSX",  tsx,     IMP, 1, 2, None  ) \
+    X(0x8a, "TXA",  txa,     IMP, 1, 2, None  ) \
+    X(0x9a, "TXS",  txs,     IMP, 1, 2, None  ) \
+    X(0x98, "TYA",  tya,     IMP, 1, 2, None  ) \
+    X(0xc7, "*DCP", dcp,     ZPG, 2, 5, None  ) \
+    X(0xd7, "*DCP", dcp,     ZPX, 2, 6, None  ) \
+    X(0xcf, "*DCP", dcp,     ABS, 3, 6, None  ) \
+    X(0xdf, "*DCP", dcp,     ABX, 3, 6, Page  ) \
+    X(0xdb, "*DCP", dcp,     ABY, 3, 6, Page  ) \
+    X(0xc3, "*DCP", dcp,     INX, 2, 8, None  ) \
+    X(0xd3, "*DCP", dcp,     INY, 2, 7, Page  ) \
+    X(0xe7, "*ISB", isb,     ZPG, 2, 5, None  ) \
+    X(0xf7, "*ISB", isb,     ZPX, 2, 6, None  ) \
+    X(0xef, "*ISB", isb,     ABS, 3, 6, None  ) \
+    X(0xff, "*ISB", isb,     ABX, 3, 6, Page  ) \
+    X(0xfb, "*ISB", isb,     ABY, 3, 6, Page  ) \
+    X(0xe3, "*ISB", isb,     INX, 2, 8, None  ) \
+    X(0xf3, "*ISB", isb,     INY, 2, 7, Page  ) \
+    /* X(0x02, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    /* X(0x12, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    /* X(0x22, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    /* X(0x32, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    /* X(0x42, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    /* X(0x52, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    /* X(0x62, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    /* X(0x72, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    /* X(0x92, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    /* X(0xb2, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    /* X(0xd2, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    /* X(0xf2, "*JAM", jam,     IMP, 1, 0, None  ) */ \
+    X(0xa7, "*LAX", lax,     ZPG, 2, 3, None  ) \
+    X(0xb7, "*LAX", lax,     ZPY, 2, 4, None  ) \
+    X(0xaf, "*LAX", lax,     ABS, 3, 4, None  ) \
+    X(0xbf, "*LAX", lax,     ABY, 3, 4, Page  ) \
+    X(0xa3, "*LAX", lax,     INX, 2, 6, None  ) \
+    X(0xb3, "*LAX", lax,     INY, 2, 5, Page  ) \
+    X(0x1a, "*NOP", nop,     IMP, 1, 2, None  ) \
+    X(0x3a, "*NOP", nop,     IMP, 1, 2, None  ) \
+    X(0x5a, "*NOP", nop,     IMP, 1, 2, None  ) \
+    X(0x7a, "*NOP", nop,     IMP, 1, 2, None  ) \
+    X(0xda, "*NOP", nop,     IMP, 1, 2, None  ) \
+    X(0xfa, "*NOP", nop,     IMP, 1, 2, None  ) \
+    X(0x80, "*NOP", nop,     IMM, 2, 2, None  ) \
+    /* X(0x82, "*NOP", nop,     IMM, 2, 2, None  ) */ \
+    /* X(0x89, "*NOP", nop,     IMM, 2, 2, None  ) */ \
+    /* X(0xc2, "*NOP", nop,     IMM, 2, 2, None  ) */ \
+    /* X(0xe2, "*NOP", nop,     IMM, 2, 2, None  ) */ \
+    X(0x04, "*NOP", nop,     ZPG, 2, 3, None  ) \
+    X(0x44, "*NOP", nop,     ZPG, 2, 3, None  ) \
+    X(0x64, "*NOP", nop,     ZPG, 2, 3, None  ) \
+    X(0x14, "*NOP", nop,     ZPX, 2, 4, None  ) \
+    X(0x34, "*NOP", nop,     ZPX, 2, 4, None  ) \
+    X(0x54, "*NOP", nop,     ZPX, 2, 4, None  ) \
+    X(0x74, "*NOP", nop,     ZPX, 2, 4, None  ) \
+    X(0xd4, "*NOP", nop,     ZPX, 2, 4, None  ) \
+    X(0xf4, "*NOP", nop,     ZPX, 2, 4, None  ) \
+    X(0x0c, "*NOP", nop,     ABS, 3, 4, None  ) \
+    X(0x1c, "*NOP", nop,     ABX, 3, 4, Page  ) \
+    X(0x3c, "*NOP", nop,     ABX, 3, 4, Page  ) \
+    X(0x5c, "*NOP", nop,     ABX, 3, 4, Page  ) \
+    X(0x7c, "*NOP", nop,     ABX, 3, 4, Page  ) \
+    X(0xdc, "*NOP", nop,     ABX, 3, 4, Page  ) \
+    X(0xfc, "*NOP", nop,     ABX, 3, 4, Page  ) \
+    X(0x27, "*RLA", rla,     ZPG, 2, 5, None  ) \
+    X(0x37, "*RLA", rla,     ZPX, 2, 6, None  ) \
+    X(0x2f, "*RLA", rla,     ABS, 3, 6, None  ) \
+    X(0x3f, "*RLA", rla,     ABX, 3, 6, Page  ) \
+    X(0x3b, "*RLA", rla,     ABY, 3, 6, Page  ) \
+    X(0x23, "*RLA", rla,     INX, 2, 8, None  ) \
+    X(0x33, "*RLA", rla,     INY, 2, 7, Page  ) \
+    X(0x67, "*RRA", rra,     ZPG, 2, 5, None  ) \
+    X(0x77, "*RRA", rra,     ZPX, 2, 6, None  ) \
+    X(0x6f, "*RRA", rra,     ABS, 3, 6, None  ) \
+    X(0x7f, "*RRA", rra,     ABX, 3, 6, Page  ) \
+    X(0x7b, "*RRA", rra,     ABY, 3, 6, Page  ) \
+    X(0x63, "*RRA", rra,     INX, 2, 8, None  ) \
+    X(0x73, "*RRA", rra,     INY, 2, 7, Page  ) \
+    X(0x87, "*SAX", sax,     ZPG, 2, 3, None  ) \
+    X(0x97, "*SAX", sax,     ZPY, 2, 4, None  ) \
+    X(0x8f, "*SAX", sax,     ABS, 3, 4, None  ) \
+    X(0x83, "*SAX", sax,     INX, 2, 6, None  ) \
+    X(0xeb, "*SBC", sbc,     IMM, 2, 2, None  ) \
+    X(0x07, "*SLO", slo,     ZPG, 2, 5, None  ) \
+    X(0x17, "*SLO", slo,     ZPX, 2, 6, None  ) \
+    X(0x0f, "*SLO", slo,     ABS, 3, 6, None  ) \
+    X(0x1f, "*SLO", slo,     ABX, 3, 6, Page  ) \
+    X(0x1b, "*SLO", slo,     ABY, 3, 6, Page  ) \
+    X(0x03, "*SLO", slo,     INX, 2, 8, None  ) \
+    X(0x13, "*SLO", slo,     INY, 2, 7, Page  ) \
+    X(0x47, "*SRE", sre,     ZPG, 2, 5, None  ) \
+    X(0x57, "*SRE", sre,     ZPX, 2, 6, None  ) \
+    X(0x4f, "*SRE", sre,     ABS, 3, 6, None  ) \
+    X(0x5f, "*SRE", sre,     ABX, 3, 6, Page  ) \
+    X(0x5b, "*SRE", sre,     ABY, 3, 6, Page  ) \
+    X(0x43, "*SRE", sre,     INX, 2, 8, None  ) \
+    X(0x53, "*SRE", sre,     INY, 2, 7, Page  ) \
+
+#define INSTRUCTION_ENTRY(opcode, mnemonic, function, addressing_mode, length, cycle, cycle_mode) \
+    {opcode, mnemonic, function, addressing_mode, length, cycle, cycle_mode},
+
 Instruction instruction[] = {
-    {0x69, "ADC",  adc,     IMM, 2, 2, None  },
-    {0x65, "ADC",  adc,     ZPG, 2, 3, None  },
-    {0x75, "ADC",  adc,     ZPX, 2, 4, None  },
-    {0x6d, "ADC",  adc,     ABS, 3, 4, None  },
-    {0x7d, "ADC",  adc,     ABX, 3, 4, Page  },
-    {0x79, "ADC",  adc,     ABY, 3, 4, Page  },
-    {0x61, "ADC",  adc,     INX, 2, 6, None  },
-    {0x71, "ADC",  adc,     INY, 2, 5, Page  },
-    {0x29, "AND",  and,     IMM, 2, 2, None  },
-    {0x25, "AND",  and,     ZPG, 2, 3, None  },
-    {0x35, "AND",  and,     ZPX, 2, 4, None  },
-    {0x2d, "AND",  and,     ABS, 3, 4, None  },
-    {0x3d, "AND",  and,     ABX, 3, 4, Page  },
-    {0x39, "AND",  and,     ABY, 3, 4, Page  },
-    {0x21, "AND",  and,     INX, 2, 6, None  },
-    {0x31, "AND",  and,     INY, 2, 5, Page  },
-    {0x0a, "ASL",  asl_acc, ACC, 1, 2, None  },
-    {0x06, "ASL",  asl,     ZPG, 2, 5, None  },
-    {0x16, "ASL",  asl,     ZPX, 2, 6, None  },
-    {0x0e, "ASL",  asl,     ABS, 3, 6, None  },
-    {0x1e, "ASL",  asl,     ABX, 3, 7, None  },
-    {0x90, "BCC",  bcc,     REL, 2, 2, Branch},
-    {0xb0, "BCS",  bcs,     REL, 2, 2, Branch},
-    {0xf0, "BEQ",  beq,     REL, 2, 2, Branch},
-    {0x24, "BIT",  bit,     ZPG, 2, 3, None  },
-    {0x2c, "BIT",  bit,     ABS, 3, 4, None  },
-    {0x30, "BMI",  bmi,     REL, 2, 2, Branch},
-    {0xd0, "BNE",  bne,     REL, 2, 2, Branch},
-    {0x10, "BPL",  bpl,     REL, 2, 2, Branch},
-    {0x00, "BRK",  _brk,    IMP, 1, 7, None  },
-    {0x50, "BVC",  bvc,     REL, 2, 2, Branch},
-    {0x70, "BVS",  bvs,     REL, 2, 2, Branch},
-    {0x18, "CLC",  clc,     IMP, 1, 2, None  },
-    {0xd8, "CLD",  cld,     IMP, 1, 2, None  },
-    {0x58, "CLI",  cli,     IMP, 1, 2, None  },
-    {0xb8, "CLV",  clv,     IMP, 1, 2, None  },
-    {0xc9, "CMP",  cmp,     IMM, 2, 2, None  },
-    {0xc5, "CMP",  cmp,     ZPG, 2, 3, None  },
-    {0xd5, "CMP",  cmp,     ZPX, 2, 4, None  },
-    {0xcd, "CMP",  cmp,     ABS, 3, 4, None  },
-    {0xdd, "CMP",  cmp,     ABX, 3, 4, Page  },
-    {0xd9, "CMP",  cmp,     ABY, 3, 4, Page  },
-    {0xc1, "CMP",  cmp,     INX, 2, 6, None  },
-    {0xd1, "CMP",  cmp,     INY, 2, 5, Page  },
-    {0xe0, "CPX",  cpx,     IMM, 2, 2, None  },
-    {0xe4, "CPX",  cpx,     ZPG, 2, 3, None  },
-    {0xec, "CPX",  cpx,     ABS, 3, 4, None  },
-    {0xc0, "CPY",  cpy,     IMM, 2, 2, None  },
-    {0xc4, "CPY",  cpy,     ZPG, 2, 3, None  },
-    {0xcc, "CPY",  cpy,     ABS, 3, 4, None  },
-    {0xc6, "DEC",  dec,     ZPG, 2, 5, None  },
-    {0xd6, "DEC",  dec,     ZPX, 2, 6, None  },
-    {0xce, "DEC",  dec,     ABS, 3, 6, None  },
-    {0xde, "DEC",  dec,     ABX, 3, 7, None  },
-    {0xca, "DEX",  dex,     IMP, 1, 2, None  },
-    {0x88, "DEY",  dey,     IMP, 1, 2, None  },
-    {0x49, "EOR",  eor,     IMM, 2, 2, None  },
-    {0x45, "EOR",  eor,     ZPG, 2, 3, None  },
-    {0x55, "EOR",  eor,     ZPX, 2, 4, None  },
-    {0x4d, "EOR",  eor,     ABS, 3, 4, None  },
-    {0x5d, "EOR",  eor,     ABX, 3, 4, Page  },
-    {0x59, "EOR",  eor,     ABY, 3, 4, Page  },
-    {0x41, "EOR",  eor,     INX, 2, 6, None  },
-    {0x51, "EOR",  eor,     INY, 2, 5, Page  },
-    {0xe6, "INC",  inc,     ZPG, 2, 5, None  },
-    {0xf6, "INC",  inc,     ZPX, 2, 6, None  },
-    {0xee, "INC",  inc,     ABS, 3, 6, None  },
-    {0xfe, "INC",  inc,     ABX, 3, 7, None  },
-    {0xe8, "INX",  inx,     IMP, 1, 2, None  },
-    {0xc8, "INY",  iny,     IMP, 1, 2, None  },
-    {0x4c, "JMP",  jmp,     ABS, 3, 3, None  },
-    {0x6c, "JMP",  jmp,     IND, 3, 5, None  },
-    {0x20, "JSR",  jsr,     ABS, 3, 6, None  },
-    {0xa9, "LDA",  lda,     IMM, 2, 2, None  },
-    {0xa5, "LDA",  lda,     ZPG, 2, 3, None  },
-    {0xb5, "LDA",  lda,     ZPX, 2, 4, None  },
-    {0xad, "LDA",  lda,     ABS, 3, 4, None  },
-    {0xbd, "LDA",  lda,     ABX, 3, 4, Page  },
-    {0xb9, "LDA",  lda,     ABY, 3, 4, Page  },
-    {0xa1, "LDA",  lda,     INX, 2, 6, None  },
-    {0xb1, "LDA",  lda,     INY, 2, 5, Page  },
-    {0xa2, "LDX",  ldx,     IMM, 2, 2, None  },
-    {0xa6, "LDX",  ldx,     ZPG, 2, 3, None  },
-    {0xb6, "LDX",  ldx,     ZPY, 2, 4, None  },
-    {0xae, "LDX",  ldx,     ABS, 3, 4, None  },
-    {0xbe, "LDX",  ldx,     ABY, 3, 4, Page  },
-    {0xa0, "LDY",  ldy,     IMM, 2, 2, None  },
-    {0xa4, "LDY",  ldy,     ZPG, 2, 3, None  },
-    {0xb4, "LDY",  ldy,     ZPX, 2, 4, None  },
-    {0xac, "LDY",  ldy,     ABS, 3, 4, None  },
-    {0xbc, "LDY",  ldy,     ABX, 3, 4, Page  },
-    {0x4a, "LSR",  lsr_acc, ACC, 1, 2, None  },
-    {0x46, "LSR",  lsr,     ZPG, 2, 5, None  },
-    {0x56, "LSR",  lsr,     ZPX, 2, 6, None  },
-    {0x4e, "LSR",  lsr,     ABS, 3, 6, None  },
-    {0x5e, "LSR",  lsr,     ABX, 3, 7, None  },
-    {0xea, "NOP",  nop,     IMP, 1, 2, None  },
-    {0x09, "ORA",  ora,     IMM, 2, 2, None  },
-    {0x05, "ORA",  ora,     ZPG, 2, 3, None  },
-    {0x15, "ORA",  ora,     ZPX, 2, 4, None  },
-    {0x0d, "ORA",  ora,     ABS, 3, 4, None  },
-    {0x1d, "ORA",  ora,     ABX, 3, 4, Page  },
-    {0x19, "ORA",  ora,     ABY, 3, 4, Page  },
-    {0x01, "ORA",  ora,     INX, 2, 6, None  },
-    {0x11, "ORA",  ora,     INY, 2, 5, Page  },
-    {0x48, "PHA",  pha,     IMP, 1, 3, None  },
-    {0x08, "PHP",  php,     IMP, 1, 3, None  },
-    {0x68, "PLA",  pla,     IMP, 1, 4, None  },
-    {0x28, "PLP",  plp,     IMP, 1, 4, None  },
-    {0x2a, "ROL",  rol_acc, ACC, 1, 2, None  },
-    {0x26, "ROL",  rol,     ZPG, 2, 5, None  },
-    {0x36, "ROL",  rol,     ZPX, 2, 6, None  },
-    {0x2e, "ROL",  rol,     ABS, 3, 6, None  },
-    {0x3e, "ROL",  rol,     ABX, 3, 7, None  },
-    {0x6a, "ROR",  ror_acc, ACC, 1, 2, None  },
-    {0x66, "ROR",  ror,     ZPG, 2, 5, None  },
-    {0x76, "ROR",  ror,     ZPX, 2, 6, None  },
-    {0x6e, "ROR",  ror,     ABS, 3, 6, None  },
-    {0x7e, "ROR",  ror,     ABX, 3, 7, None  },
-    {0x40, "RTI",  rti,     IMP, 1, 6, None  },
-    {0x60, "RTS",  rts,     IMP, 1, 6, None  },
-    {0xe9, "SBC",  sbc,     IMM, 2, 2, None  },
-    {0xe5, "SBC",  sbc,     ZPG, 2, 3, None  },
-    {0xf5, "SBC",  sbc,     ZPX, 2, 4, None  },
-    {0xed, "SBC",  sbc,     ABS, 3, 4, None  },
-    {0xfd, "SBC",  sbc,     ABX, 3, 4, Page  },
-    {0xf9, "SBC",  sbc,     ABY, 3, 4, Page  },
-    {0xe1, "SBC",  sbc,     INX, 2, 6, None  },
-    {0xf1, "SBC",  sbc,     INY, 2, 5, Page  },
-    {0x38, "SEC",  sec,     IMP, 1, 2, None  },
-    {0xf8, "SED",  sed,     IMP, 1, 2, None  },
-    {0x78, "SEI",  sei,     IMP, 1, 2, None  },
-    {0x85, "STA",  sta,     ZPG, 2, 3, None  },
-    {0x95, "STA",  sta,     ZPX, 2, 4, None  },
-    {0x8d, "STA",  sta,     ABS, 3, 4, None  },
-    {0x9d, "STA",  sta,     ABX, 3, 5, None  },
-    {0x99, "STA",  sta,     ABY, 3, 5, None  },
-    {0x81, "STA",  sta,     INX, 2, 6, None  },
-    {0x91, "STA",  sta,     INY, 2, 6, None  },
-    {0x86, "STX",  stx,     ZPG, 2, 3, None  },
-    {0x96, "STX",  stx,     ZPY, 2, 4, None  },
-    {0x8e, "STX",  stx,     ABS, 3, 4, None  },
-    {0x84, "STY",  sty,     ZPG, 2, 3, None  },
-    {0x94, "STY",  sty,     ZPX, 2, 4, None  },
-    {0x8c, "STY",  sty,     ABS, 3, 4, None  },
-    {0xaa, "TAX",  tax,     IMP, 1, 2, None  },
-    {0xa8, "TAY",  tay,     IMP, 1, 2, None  },
-    {0xba, "TSX",  tsx,     IMP, 1, 2, None  },
-    {0x8a, "TXA",  txa,     IMP, 1, 2, None  },
-    {0x9a, "TXS",  txs,     IMP, 1, 2, None  },
-    {0x98, "TYA",  tya,     IMP, 1, 2, None  },
-    {0xc7, "*DCP", dcp,     ZPG, 2, 5, None  },
-    {0xd7, "*DCP", dcp,     ZPX, 2, 6, None  },
-    {0xcf, "*DCP", dcp,     ABS, 3, 6, None  },
-    {0xdf, "*DCP", dcp,     ABX, 3, 6, Page  },
-    {0xdb, "*DCP", dcp,     ABY, 3, 6, Page  },
-    {0xc3, "*DCP", dcp,     INX, 2, 8, None  },
-    {0xd3, "*DCP", dcp,     INY, 2, 7, Page  },
-    {0xe7, "*ISB", isb,     ZPG, 2, 5, None  },
-    {0xf7, "*ISB", isb,     ZPX, 2, 6, None  },
-    {0xef, "*ISB", isb,     ABS, 3, 6, None  },
-    {0xff, "*ISB", isb,     ABX, 3, 6, Page  },
-    {0xfb, "*ISB", isb,     ABY, 3, 6, Page  },
-    {0xe3, "*ISB", isb,     INX, 2, 8, None  },
-    {0xf3, "*ISB", isb,     INY, 2, 7, Page  },
-    // {0x02, "*JAM", jam,     IMP, 1, 0, None  },
-    // {0x12, "*JAM", jam,     IMP, 1, 0, None  },
-    // {0x22, "*JAM", jam,     IMP, 1, 0, None  },
-    // {0x32, "*JAM", jam,     IMP, 1, 0, None  },
-    // {0x42, "*JAM", jam,     IMP, 1, 0, None  },
-    // {0x52, "*JAM", jam,     IMP, 1, 0, None  },
-    // {0x62, "*JAM", jam,     IMP, 1, 0, None  },
-    // {0x72, "*JAM", jam,     IMP, 1, 0, None  },
-    // {0x92, "*JAM", jam,     IMP, 1, 0, None  },
-    // {0xb2, "*JAM", jam,     IMP, 1, 0, None  },
-    // {0xd2, "*JAM", jam,     IMP, 1, 0, None  },
-    // {0xf2, "*JAM", jam,     IMP, 1, 0, None  },
-    {0xa7, "*LAX", lax,     ZPG, 2, 3, None  },
-    {0xb7, "*LAX", lax,     ZPY, 2, 4, None  },
-    {0xaf, "*LAX", lax,     ABS, 3, 4, None  },
-    {0xbf, "*LAX", lax,     ABY, 3, 4, Page  },
-    {0xa3, "*LAX", lax,     INX, 2, 6, None  },
-    {0xb3, "*LAX", lax,     INY, 2, 5, Page  },
-    {0x1a, "*NOP", nop,     IMP, 1, 2, None  },
-    {0x3a, "*NOP", nop,     IMP, 1, 2, None  },
-    {0x5a, "*NOP", nop,     IMP, 1, 2, None  },
-    {0x7a, "*NOP", nop,     IMP, 1, 2, None  },
-    {0xda, "*NOP", nop,     IMP, 1, 2, None  },
-    {0xfa, "*NOP", nop,     IMP, 1, 2, None  },
-    {0x80, "*NOP", nop,     IMM, 2, 2, None  },
-    // {0x82, "*NOP", nop,     IMM, 2, 2, None  },
-    // {0x89, "*NOP", nop,     IMM, 2, 2, None  },
-    // {0xc2, "*NOP", nop,     IMM, 2, 2, None  },
-    // {0xe2, "*NOP", nop,     IMM, 2, 2, None  },
-    {0x04, "*NOP", nop,     ZPG, 2, 3, None  },
-    {0x44, "*NOP", nop,     ZPG, 2, 3, None  },
-    {0x64, "*NOP", nop,     ZPG, 2, 3, None  },
-    {0x14, "*NOP", nop,     ZPX, 2, 4, None  },
-    {0x34, "*NOP", nop,     ZPX, 2, 4, None  },
-    {0x54, "*NOP", nop,     ZPX, 2, 4, None  },
-    {0x74, "*NOP", nop,     ZPX, 2, 4, None  },
-    {0xd4, "*NOP", nop,     ZPX, 2, 4, None  },
-    {0xf4, "*NOP", nop,     ZPX, 2, 4, None  },
-    {0x0c, "*NOP", nop,     ABS, 3, 4, None  },
-    {0x1c, "*NOP", nop,     ABX, 3, 4, Page  },
-    {0x3c, "*NOP", nop,     ABX, 3, 4, Page  },
-    {0x5c, "*NOP", nop,     ABX, 3, 4, Page  },
-    {0x7c, "*NOP", nop,     ABX, 3, 4, Page  },
-    {0xdc, "*NOP", nop,     ABX, 3, 4, Page  },
-    {0xfc, "*NOP", nop,     ABX, 3, 4, Page  },
-    {0x27, "*RLA", rla,     ZPG, 2, 5, None  },
-    {0x37, "*RLA", rla,     ZPX, 2, 6, None  },
-    {0x2f, "*RLA", rla,     ABS, 3, 6, None  },
-    {0x3f, "*RLA", rla,     ABX, 3, 6, Page  },
-    {0x3b, "*RLA", rla,     ABY, 3, 6, Page  },
-    {0x23, "*RLA", rla,     INX, 2, 8, None  },
-    {0x33, "*RLA", rla,     INY, 2, 7, Page  },
-    {0x67, "*RRA", rra,     ZPG, 2, 5, None  },
-    {0x77, "*RRA", rra,     ZPX, 2, 6, None  },
-    {0x6f, "*RRA", rra,     ABS, 3, 6, None  },
-    {0x7f, "*RRA", rra,     ABX, 3, 6, Page  },
-    {0x7b, "*RRA", rra,     ABY, 3, 6, Page  },
-    {0x63, "*RRA", rra,     INX, 2, 8, None  },
-    {0x73, "*RRA", rra,     INY, 2, 7, Page  },
-    {0x87, "*SAX", sax,     ZPG, 2, 3, None  },
-    {0x97, "*SAX", sax,     ZPY, 2, 4, None  },
-    {0x8f, "*SAX", sax,     ABS, 3, 4, None  },
-    {0x83, "*SAX", sax,     INX, 2, 6, None  },
-    {0xeb, "*SBC", sbc,     IMM, 2, 2, None  },
-    {0x07, "*SLO", slo,     ZPG, 2, 5, None  },
-    {0x17, "*SLO", slo,     ZPX, 2, 6, None  },
-    {0x0f, "*SLO", slo,     ABS, 3, 6, None  },
-    {0x1f, "*SLO", slo,     ABX, 3, 6, Page  },
-    {0x1b, "*SLO", slo,     ABY, 3, 6, Page  },
-    {0x03, "*SLO", slo,     INX, 2, 8, None  },
-    {0x13, "*SLO", slo,     INY, 2, 7, Page  },
-    {0x47, "*SRE", sre,     ZPG, 2, 5, None  },
-    {0x57, "*SRE", sre,     ZPX, 2, 6, None  },
-    {0x4f, "*SRE", sre,     ABS, 3, 6, None  },
-    {0x5f, "*SRE", sre,     ABX, 3, 6, Page  },
-    {0x5b, "*SRE", sre,     ABY, 3, 6, Page  },
-    {0x43, "*SRE", sre,     INX, 2, 8, None  },
-    {0x53, "*SRE", sre,     INY, 2, 7, Page  },
+    INSTRUCTION_LIST(INSTRUCTION_ENTRY)
+};
+
+// スーパー命令
+// よく使われる2命令の組を続けて実行する (特殊化ディスパッチではrun_cycles_fastのfuse、ブロックキャッシュとJITではデコード時にまとめたハンドラ)
+// 2命令目は1命令目の後に通常どおり実行されるので、tick()とバスアクセスの順序は個別に実行した場合と同じ
+// 分岐先が1命令目の場合(待機ループ)は、ディスパッチやブロックの実行に戻らずに繰り返す
+typedef enum {
+    LDA_STATUS_BPL,
+    DEX_BNE,
+    DEY_BNE,
+    LDA_ABX_STA_DATA,
+    SUPERINSTRUCTION_COUNT
+} Superinstruction;
+
+char *superinstruction_name[SUPERINSTRUCTION_COUNT] = {
+    "LDA $2002 / BPL",
+    "DEX / BNE",
+    "DEY / BNE",
+    "LDA abs,X / STA $2007"
+};
+
+unsigned int superinstruction_count[SUPERINSTRUCTION_COUNT];
+
+#ifdef SUPERINSTRUCTION_PROFILE
+#define COUNT_SUPERINSTRUCTION(kind) (superinstruction_count[kind] += 1)
+#else
+#define COUNT_SUPERINSTRUCTION(kind)
+#endif
+
+// 特殊化ディスパッチ
+// INSTRUCTION_LISTからオペコードごとのラベルを生成し、computed gotoで直接ジャンプする
+// アドレッシングモードとサイクル数は定数として埋め込まれ、命令の関数も直接呼び出される
+
+static inline __attribute__((always_inline)) void execute(unsigned char opcode, void (*function)(void), Addressing_Mode addressing_mode, unsigned short length, unsigned int cycle, Cycle_Mode cycle_mode) {
+    cpu.extra_cycle = 0;
+    cpu.cycle_mode = cycle_mode;
+    cpu.address = get_address(addressing_mode);
+#ifdef NESTEST
+    _log(instruction_table[opcode]);
+#endif
+    function();
+    cpu.pc += length;
+    tick(cycle + cpu.extra_cycle);
+}
+
+#define INSTRUCTION_LABEL(opcode, mnemonic, function, addressing_mode, length, cycle, cycle_mode) \
+    [opcode] = &&opcode_##opcode,
+
+// スーパー命令の1命令目 (実行後にfuseで次の命令を調べる)
+#define IS_SUPERINSTRUCTION_FIRST(opcode) ((opcode) == 0xad || (opcode) == 0xbd || (opcode) == 0xca || (opcode) == 0x88)
+
+// 分岐命令は、後方へ分岐した場合にアイドルループを見張る (block.cのwatch_idle_loop)
+#define INSTRUCTION_HANDLER(opcode, mnemonic, function, addressing_mode, length, cycle, cycle_mode) \
+    opcode_##opcode: \
+        if(cycle_mode == Branch) { \
+            branch_pc = cpu.pc; \
+        } \
+        execute(opcode, function, addressing_mode, length, cycle, cycle_mode); \
+        if(IS_SUPERINSTRUCTION_FIRST(opcode)) { \
+            goto fuse; \
+        } \
+        if(cycle_mode == Branch && cpu.pc < branch_pc) { \
+            watch_idle_loop(); \
+        } \
+        goto next;
+
+// run_cyclesと同じ条件で停止する
+unsigned int run_cycles_fast(unsigned int budget) {
+    static void *dispatch_table[256] = {
+        [0 ... 255] = &&invalid_opcode,
+        INSTRUCTION_LIST(INSTRUCTION_LABEL)
+    };
+    unsigned long long start_cycle = begin_run(budget);
+    unsigned char opcode;
+    unsigned short loop_pc, branch_pc;
+    Superinstruction kind;
+next:
+    if(cpu_cycle >= cpu_deadline && continue_run() == false) {
+        return cpu_cycle - start_cycle;
+    }
+    instruction_count += 1;
+    opcode = read8(cpu.pc);
+    goto *dispatch_table[opcode];
+    INSTRUCTION_LIST(INSTRUCTION_HANDLER)
+fuse:
+    // 1命令目(opcode)に組になる命令が続く場合は、ディスパッチテーブルを経由せずに2命令目を実行する
+    if(cpu_cycle >= cpu_deadline) {
+        goto next;
+    }
+    switch(opcode) {
+        case 0xad:
+            // LDA $2002 / BPL (VBLANKの待機)
+            if(cpu.address != 0x2002 || read8(cpu.pc) != 0x10) {
+                goto next;
+            }
+            kind = LDA_STATUS_BPL;
+            loop_pc = cpu.pc - 3;
+            break;
+        case 0xca:
+        case 0x88:
+            // DEX / BNE、DEY / BNE (ウェイトループ)
+            if(read8(cpu.pc) != 0xd0) {
+                goto next;
+            }
+            kind = opcode == 0xca ? DEX_BNE : DEY_BNE;
+            loop_pc = cpu.pc - 1;
+            break;
+        default:
+            // LDA abs,X / STA abs (STA $2007はVRAMへの転送)
+            if(read8(cpu.pc) != 0x8d) {
+                goto next;
+            }
+            instruction_count += 1;
+            execute(0x8d, sta, ABS, 3, 4, None);
+            if(cpu.address == 0x2007) {
+                COUNT_SUPERINSTRUCTION(LDA_ABX_STA_DATA);
+            }
+            goto next;
+    }
+    COUNT_SUPERINSTRUCTION(kind);
+    instruction_count += 1;
+    if(kind == LDA_STATUS_BPL) {
+        execute(0x10, bpl, REL, 2, 2, Branch);
+    } else {
+        execute(0xd0, bne, REL, 2, 2, Branch);
+    }
+    if(cpu.pc != loop_pc || cpu_cycle >= cpu_deadline) {
+        goto next;
+    }
+    // 分岐先が1命令目なので、ディスパッチテーブルを経由せずに戻る
+    watch_idle_loop();
+    if(cpu_cycle >= cpu_deadline) {
+        goto next;
+    }
+    instruction_count += 1;
+    opcode = read8(cpu.pc);
+    switch(opcode) {
+        case 0xad:
+            goto opcode_0xad;
+        case 0xca:
+            goto opcode_0xca;
+        case 0x88:
+            goto opcode_0x88;
+    }
+    goto *dispatch_table[opcode];
+invalid_opcode:
+    error("Invalid opcode 0x%02X\n", opcode);
+    return 0;
+}
+
+// デコード済みの命令ハンドラ
+// オペランドは呼び出し側が事前に読み込んでおき、命令バイトをバスから読み直さない
+// 次の命令へそのまま進めない場合(分岐、ジャンプ、cpu_deadlineに到達)はfalseを返す
+static inline __attribute__((always_inline)) bool execute_predecoded(unsigned short operand, void (*function)(void), Addressing_Mode addressing_mode, unsigned short length, unsigned int cycle, Cycle_Mode cycle_mode) {
+    unsigned short next_pc = cpu.pc + length;
+    cpu.extra_cycle = 0;
+    cpu.cycle_mode = cycle_mode;
+    cpu.address = resolve_address(addressing_mode, operand);
+    function();
+    cpu.pc += length;
+    tick(cycle + cpu.extra_cycle);
+    instruction_count += 1;
+    return cpu.pc == next_pc && cpu_cycle < cpu_deadline;
+}
+
+#define INSTRUCTION_PREDECODED(opcode, mnemonic, function, addressing_mode, length, cycle, cycle_mode) \
+    bool predecoded_##opcode(unsigned short operand) { \
+        return execute_predecoded(operand, function, addressing_mode, length, cycle, cycle_mode); \
+    }
+
+#define INSTRUCTION_PREDECODED_ENTRY(opcode, mnemonic, function, addressing_mode, length, cycle, cycle_mode) \
+    [opcode] = predecoded_##opcode,
+
+INSTRUCTION_LIST(INSTRUCTION_PREDECODED)
+
+bool (*predecoded_handler[256])(unsigned short operand) = {
+    INSTRUCTION_LIST(INSTRUCTION_PREDECODED_ENTRY)
 };
 
+// 命令1つとそれに続く分岐命令を、分岐先が先頭の命令である限り繰り返す
+static inline __attribute__((always_inline)) bool loop_until_branch(Superinstruction kind, bool (*first)(unsigned short), unsigned short first_operand, bool (*branch)(unsigned short), unsigned short branch_operand) {
+    unsigned short pc = cpu.pc;
+    do {
+        COUNT_SUPERINSTRUCTION(kind);
+        if(first(first_operand) == false) {
+            return false;
+        }
+        if(branch(branch_operand)) {
+            return true;
+        }
+    } while(cpu.pc == pc && cpu_cycle < cpu_deadline);
+    return false;
+}
+
+// LDA $2002 / BPL (VBLANKの待機)
+bool superinstruction_lda_status_bpl(unsigned short operand) {
+    return loop_until_branch(LDA_STATUS_BPL, predecoded_0xad, 0x2002, predecoded_0x10, operand);
+}
+
+// DEX / BNE (ウェイトループ)
+bool superinstruction_dex_bne(unsigned short operand) {
+    return loop_until_branch(DEX_BNE, predecoded_0xca, 0, predecoded_0xd0, operand);
+}
+
+// DEY / BNE (ウェイトループ)
+bool superinstruction_dey_bne(unsigned short operand) {
+    return loop_until_branch(DEY_BNE, predecoded_0x88, 0, predecoded_0xd0, operand);
+}
+
+// LDA abs,X / STA $2007 (VRAMへの転送)
+bool superinstruction_lda_abx_sta_data(unsigned short operand) {
+    COUNT_SUPERINSTRUCTION(LDA_ABX_STA_DATA);
+    return predecoded_0xbd(operand) && predecoded_0x8d(0x2007);
+}
+
+// 2命令の組をスーパー命令にできる場合はそのハンドラを返し、operandにまとめたオペランドを設定する
+bool (*find_superinstruction(unsigned char first, unsigned short first_operand, unsigned char second, unsigned short second_operand, unsigned short *operand))(unsigned short) {
+    if(first == 0xad && first_operand == 0x2002 && second == 0x10) {
+        *operand = second_operand;
+        return superinstruction_lda_status_bpl;
+    } else if(first == 0xca && second == 0xd0) {
+        *operand = second_operand;
+        return superinstruction_dex_bne;
+    } else if(first == 0x88 && second == 0xd0) {
+        *operand = second_operand;
+        return superinstruction_dey_bne;
+    } else if(first == 0xbd && second == 0x8d && second_operand == 0x2007) {
+        *operand = first_operand;
+        return superinstruction_lda_abx_sta_data;
+    }
+    return NULL;
+}
+
+void print_superinstruction_count(void) {
+    for(int i = 0; i < SUPERINSTRUCTION_COUNT; i++) {
+        fprintf(stderr, "%-24s %u\n", superinstruction_name[i], superinstruction_count[i]);
+    }
+}
+
 void nmi(void) {
     push16(cpu.pc);
     push8(get_flag());
     cpu.pc = read16(0xfffa);
-    cpu.p.i = true;
+    cpu.p.id |= 0x04;
     tick(2);
 }
 
+void irq(void) {
+    push16(cpu.pc);
+    push8(get_flag());
+    cpu.pc = read16(0xfffe);
+    cpu.p.id |= 0x04;
+    tick(7);
+}
+
 bool parallel_mode;
 int button_index;
 unsigned char button_status;
@@ -0,0 +1,58 @@
+#include "common.h"
+#include <stdio.h>
+#include <limits.h>
+
+// イベントスケジューラ
+// PPUのイベント(VBLANK/NMI、スプライトゼロヒット、フレーム終了)、APUのフレームカウンタ、マッパーのIRQを
+// 64ビットのcpu_cycle上の時刻で管理し、tick()で時刻に達したものだけを処理する
+// イベントの種類は少ないので、キューは種類ごとの時刻の配列で、最も早い時刻をnext_event_cycleに保持する
+
+extern unsigned long long cpu_cycle;
+
+unsigned long long event_cycle[EVENT_COUNT];
+void (*event_handler[EVENT_COUNT])(void);
+unsigned long long next_event_cycle = ULLONG_MAX;
+
+void update_next_event(void) {
+    next_event_cycle = ULLONG_MAX;
+    for(int i = 0; i < EVENT_COUNT; i++) {
+        if(event_cycle[i] < next_event_cycle) {
+            next_event_cycle = event_cycle[i];
+        }
+    }
+}
+
+void init_event(void) {
+    for(int i = 0; i < EVENT_COUNT; i++) {
+        event_cycle[i] = ULLONG_MAX;
+        event_handler[i] = NULL;
+    }
+    update_next_event();
+}
+
+void schedule_event(Event_Type type, unsigned long long cycle, void (*handler)(void)) {
+    event_cycle[type] = cycle;
+    event_handler[type] = handler;
+    update_next_event();
+}
+
+void cancel_event(Event_Type type) {
+    event_cycle[type] = ULLONG_MAX;
+    update_next_event();
+}
+
+// 時刻に達したイベントを早い順に処理する
+// ハンドラは次の時刻を自分で登録し直す
+void run_events(void) {
+    while(cpu_cycle >= next_event_cycle) {
+        int type = 0;
+        for(int i = 1; i < EVENT_COUNT; i++) {
+            if(event_cycle[i] < event_cycle[type]) {
+                type = i;
+            }
+        }
+        event_cycle[type] = ULLONG_MAX;
+        update_next_event();
+        event_handler[type]();
+    }
+}
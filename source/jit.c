@@ -0,0 +1,623 @@
+#include "common.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// PRG-ROM用の動的再コンパイラ (x86-64)
+// よく実行されるブロックをx86-64の機械語に変換する
+// - 即値、ゼロページ、内部RAM(0x0000-0x1fff)の絶対アドレスを使うロード/ストア、論理演算、ADC/SBC、比較、INC/DEC、
+//   アキュムレータのシフト、レジスタ間の転送、キャリーの操作は、cpuと内部RAMを直接読み書きするネイティブのコードにする
+//   (フラグはcpu.pと同じ遅延計算の形で保存する)
+// - それ以外の命令(分岐、ジャンプ、スタック、I/O、PRG-RAM、インデックス付きの絶対アドレスなど)はデコード済みの命令ハンドラ(predecoded_XX)を呼ぶ
+// - 連続するネイティブの命令は、合計のサイクル数を最後に1回のtick()で進める
+//   実行前にその間にイベントもcpu_deadlineも来ないことを確かめ、来る場合は同じ命令をハンドラで1命令ずつ実行するので、
+//   サイクル数とPPUのタイミングはインタプリタと同じになる
+// - ブロックの区切り方はblock.cのdecode_blockと共通
+// - 内部RAM上のコードは変換せずインタプリタで実行する (自己書き換えコードへの対策)
+// - ブロックはPCと変換時のPRGバンクをキーに保持し、バンクが切り替わった場合は再変換する
+// - 実行回数がJIT_THRESHOLDに達するまでは変換しない
+// - コードのバッファは普段は読み込みと実行のみ可能で、ブロックを書き込む間だけそのページを書き込み可能にする
+
+#define JIT_THRESHOLD (32)
+#define JIT_BLOCK_MAX_INSTRUCTION (64)
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+// 1ブロックのコードの大きさの上限 (1命令はネイティブのコードと、ハンドラを呼ぶ代わりのコードを合わせても256バイト未満)
+#define JIT_BLOCK_CODE_SIZE (256 * (JIT_BLOCK_MAX_INSTRUCTION + 1))
+
+extern CPU cpu;
+extern unsigned long long cpu_cycle;
+extern unsigned long long cpu_deadline;
+extern unsigned long long next_event_cycle;
+extern unsigned int instruction_count;
+extern unsigned char internal_ram[0x800];
+extern unsigned char *read_page[PAGE_COUNT];
+extern Instruction *instruction_table[256];
+extern bool (*predecoded_handler[256])(unsigned short operand);
+
+void tick(unsigned int cycle);
+void step_nes(void);
+unsigned long long begin_run(unsigned int budget);
+bool continue_run(void);
+int decode_block(unsigned short pc, Decoded_Instruction *run, int max, bool fuse);
+
+typedef struct {
+    unsigned char *bank;
+    void (*code)(void);
+    unsigned short count;
+    // 先頭の命令が変換できない場合はtrue
+    bool uncompilable;
+} JIT_Block;
+
+JIT_Block jit_block[0x8000];
+unsigned char *jit_code;
+unsigned int jit_code_used;
+// 変換したブロック数 (キャッシュを破棄するたびにリセットしない累計)
+unsigned int jit_compiled_count;
+
+// 生成するコードはrbxに&cpuを置き、cpuの各フィールド、内部RAM、cpu_cycleなどの大域変数をrbxからの32ビットの変位で参照する
+#define EAX (0)
+#define ECX (1)
+#define EDX (2)
+#define ESI (6)
+#define EDI (7)
+
+// 変位 (インデックスがある場合は[rbx + rcx + disp])
+typedef struct {
+    int disp;
+    bool indexed;
+} JIT_Memory;
+
+void emit8(unsigned char **p, unsigned char value) {
+    *(*p)++ = value;
+}
+
+void emit16(unsigned char **p, unsigned short value) {
+    memcpy(*p, &value, 2);
+    *p += 2;
+}
+
+void emit32(unsigned char **p, unsigned int value) {
+    memcpy(*p, &value, 4);
+    *p += 4;
+}
+
+void emit64(unsigned char **p, unsigned long long value) {
+    memcpy(*p, &value, 8);
+    *p += 8;
+}
+
+// 大域変数の&cpuからの変位
+int jit_offset(void *address) {
+    long long offset = (unsigned char*)address - (unsigned char*)&cpu;
+    if(offset < -0x80000000LL || offset > 0x7fffffffLL - 0x800) {
+        error("Cannot reach 0x%llx from the JIT code\n", (unsigned long long)address);
+    }
+    return offset;
+}
+
+JIT_Memory field(void *address) {
+    return (JIT_Memory){jit_offset(address), false};
+}
+
+// ModR/Mとその後の変位
+void emit_memory(unsigned char **p, int reg, JIT_Memory memory) {
+    if(memory.indexed) {
+        emit8(p, 0x84 | (reg << 3));
+        emit8(p, 0x0b);
+    } else {
+        emit8(p, 0x83 | (reg << 3));
+    }
+    emit32(p, memory.disp);
+}
+
+// movzx reg, byte [memory]
+void emit_load8(unsigned char **p, int reg, JIT_Memory memory) {
+    emit8(p, 0x0f);
+    emit8(p, 0xb6);
+    emit_memory(p, reg, memory);
+}
+
+// mov byte [memory], reg (al, cl, dl)
+void emit_store8(unsigned char **p, JIT_Memory memory, int reg) {
+    emit8(p, 0x88);
+    emit_memory(p, reg, memory);
+}
+
+// mov reg, dword [memory]
+void emit_load32(unsigned char **p, int reg, JIT_Memory memory) {
+    emit8(p, 0x8b);
+    emit_memory(p, reg, memory);
+}
+
+// mov dword [memory], reg
+void emit_store32(unsigned char **p, JIT_Memory memory, int reg) {
+    emit8(p, 0x89);
+    emit_memory(p, reg, memory);
+}
+
+// mov dword [memory], value
+void emit_store32_immediate(unsigned char **p, JIT_Memory memory, unsigned int value) {
+    emit8(p, 0xc7);
+    emit_memory(p, 0, memory);
+    emit32(p, value);
+}
+
+// add/or/and/sub/xor/mov dst, src (opcodeは00 /r形式の命令)
+void emit_alu(unsigned char **p, unsigned char opcode, int dst, int src) {
+    emit8(p, opcode);
+    emit8(p, 0xc0 | (src << 3) | dst);
+}
+
+// add/or/and/sub/xor reg, value (extensionは81 /n形式の命令の/n)
+void emit_alu_immediate(unsigned char **p, int extension, int reg, unsigned int value) {
+    emit8(p, 0x81);
+    emit8(p, 0xc0 | (extension << 3) | reg);
+    emit32(p, value);
+}
+
+#define ALU_ADD (0x01)
+#define ALU_OR (0x09)
+#define ALU_AND (0x21)
+#define ALU_SUB (0x29)
+#define ALU_XOR (0x31)
+#define ALU_MOV (0x89)
+
+// shl/shr reg, count (extensionは4 => shl、5 => shr)
+void emit_shift(unsigned char **p, int extension, int reg, unsigned char count) {
+    emit8(p, 0xc1);
+    emit8(p, 0xc0 | (extension << 3) | reg);
+    emit8(p, count);
+}
+
+// mov reg, value
+void emit_move_immediate(unsigned char **p, int reg, unsigned int value) {
+    emit8(p, 0xb8 + reg);
+    emit32(p, value);
+}
+
+// mov rax, function / call rax
+void emit_call(unsigned char **p, void *function) {
+    emit8(p, 0x48);
+    emit8(p, 0xb8);
+    emit64(p, (unsigned long long)function);
+    emit8(p, 0xff);
+    emit8(p, 0xd0);
+}
+
+// jcc rel32 (conditionは0f 8x形式の命令の下位4ビット) のrel32の位置を返す
+unsigned char *emit_jump_if(unsigned char **p, unsigned char condition) {
+    emit8(p, 0x0f);
+    emit8(p, 0x80 | condition);
+    unsigned char *rel = *p;
+    emit32(p, 0);
+    return rel;
+}
+
+unsigned char *emit_jump_always(unsigned char **p) {
+    emit8(p, 0xe9);
+    unsigned char *rel = *p;
+    emit32(p, 0);
+    return rel;
+}
+
+#define JUMP_IF_ZERO (0x04)
+#define JUMP_IF_ABOVE_OR_EQUAL (0x03)
+
+void patch_jump(unsigned char *rel, unsigned char *target) {
+    unsigned int offset = target - (rel + 4);
+    memcpy(rel, &offset, 4);
+}
+
+// update_zn (値はregの下位8ビット)
+void emit_update_zn(unsigned char **p, int reg) {
+    emit_store8(p, field(&cpu.p.z_result), reg);
+    emit_store8(p, field(&cpu.p.n_result), reg);
+}
+
+// ecx = FLAG_C
+void emit_load_carry(unsigned char **p) {
+    emit_load32(p, ECX, field(&cpu.p.carry_result));
+    emit_shift(p, 5, ECX, 8);
+    emit_alu_immediate(p, 4, ECX, 0x01);
+}
+
+bool is_jit_mnemonic(Instruction *i, char *mnemonic) {
+    return strcmp(i->mnemonic, mnemonic) == 0;
+}
+
+bool is_any_mnemonic(Instruction *i, char **mnemonic, int count) {
+    for(int index = 0; index < count; index++) {
+        if(is_jit_mnemonic(i, mnemonic[index])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 内部RAMを指すアドレッシングモードか (I/OやPRG-RAMに触れる可能性がある場合はハンドラに任せる)
+bool is_ram_operand(Instruction *i, unsigned short operand) {
+    switch(i->addressing_mode) {
+        case ZPG: case ZPX: case ZPY:
+            return true;
+        case ABS:
+            return operand < 0x2000;
+        default:
+            return false;
+    }
+}
+
+// 内部RAMのオペランドのアドレスを求める (ZPX/ZPYの場合はrcxに0x00-0xffのアドレスを置く)
+JIT_Memory emit_ram_address(unsigned char **p, Instruction *i, unsigned short operand) {
+    int ram = jit_offset(internal_ram);
+    if(i->addressing_mode == ZPX || i->addressing_mode == ZPY) {
+        emit_load8(p, ECX, field(i->addressing_mode == ZPX ? &cpu.x : &cpu.y));
+        // add cl, operand
+        emit8(p, 0x80);
+        emit8(p, 0xc1);
+        emit8(p, operand);
+        return (JIT_Memory){ram, true};
+    }
+    return (JIT_Memory){ram + (operand & 0x7ff), false};
+}
+
+char *jit_read_mnemonic[] = {"LDA", "LDX", "LDY", "AND", "ORA", "EOR", "ADC", "SBC", "CMP", "CPX", "CPY"};
+char *jit_write_mnemonic[] = {"STA", "STX", "STY", "INC", "DEC"};
+char *jit_implied_mnemonic[] = {"INX", "INY", "DEX", "DEY", "TAX", "TAY", "TXA", "TYA", "CLC", "SEC", "NOP"};
+char *jit_accumulator_mnemonic[] = {"ASL", "LSR", "ROL", "ROR"};
+
+// ネイティブのコードに変換できる命令か
+bool is_native(Instruction *i, unsigned short operand) {
+    if(is_any_mnemonic(i, jit_read_mnemonic, sizeof(jit_read_mnemonic) / sizeof(char*))) {
+        return i->addressing_mode == IMM || is_ram_operand(i, operand);
+    }
+    if(is_any_mnemonic(i, jit_write_mnemonic, sizeof(jit_write_mnemonic) / sizeof(char*))) {
+        return is_ram_operand(i, operand);
+    }
+    if(is_any_mnemonic(i, jit_implied_mnemonic, sizeof(jit_implied_mnemonic) / sizeof(char*))) {
+        return i->addressing_mode == IMP;
+    }
+    if(is_any_mnemonic(i, jit_accumulator_mnemonic, sizeof(jit_accumulator_mnemonic) / sizeof(char*))) {
+        return i->addressing_mode == ACC;
+    }
+    return false;
+}
+
+// レジスタを表すフィールド (A、X、Y)
+unsigned char *register_field(char name) {
+    return name == 'A' ? &cpu.a : name == 'X' ? &cpu.x : &cpu.y;
+}
+
+// is_nativeがtrueの命令1つをcpu.cの命令の関数と同じ結果になるように変換する (cpu.pcとサイクル数は呼び出し側が進める)
+void emit_native(unsigned char **p, Instruction *i, unsigned short operand) {
+    if(is_any_mnemonic(i, jit_read_mnemonic, sizeof(jit_read_mnemonic) / sizeof(char*))) {
+        // edx = オペランドの値
+        if(i->addressing_mode == IMM) {
+            emit_move_immediate(p, EDX, operand & 0xff);
+        } else {
+            emit_load8(p, EDX, emit_ram_address(p, i, operand));
+        }
+        if(i->mnemonic[0] == 'L') {
+            // LDA/LDX/LDY
+            emit_store8(p, field(register_field(i->mnemonic[2])), EDX);
+            emit_update_zn(p, EDX);
+        } else if(is_jit_mnemonic(i, "AND") || is_jit_mnemonic(i, "ORA") || is_jit_mnemonic(i, "EOR")) {
+            emit_load8(p, EAX, field(&cpu.a));
+            emit_alu(p, is_jit_mnemonic(i, "AND") ? ALU_AND : is_jit_mnemonic(i, "ORA") ? ALU_OR : ALU_XOR, EAX, EDX);
+            emit_store8(p, field(&cpu.a), EAX);
+            emit_update_zn(p, EAX);
+        } else if(is_jit_mnemonic(i, "ADC")) {
+            // ecx = r = a + m + C、overflow_result = (a ^ r) & (m ^ r)
+            emit_load8(p, EAX, field(&cpu.a));
+            emit_load_carry(p);
+            emit_alu(p, ALU_ADD, ECX, EAX);
+            emit_alu(p, ALU_ADD, ECX, EDX);
+            emit_store32(p, field(&cpu.p.carry_result), ECX);
+            emit_alu(p, ALU_XOR, EAX, ECX);
+            emit_alu(p, ALU_XOR, EDX, ECX);
+            emit_alu(p, ALU_AND, EAX, EDX);
+            emit_store8(p, field(&cpu.p.overflow_result), EAX);
+            emit_store8(p, field(&cpu.a), ECX);
+            emit_update_zn(p, ECX);
+        } else if(is_jit_mnemonic(i, "SBC")) {
+            // ecx = r = a + (m ^ 0xff) + C、overflow_result = (a ^ m) & (a ^ r)
+            emit_load8(p, EAX, field(&cpu.a));
+            emit_load_carry(p);
+            emit_alu(p, ALU_MOV, ESI, EDX);
+            emit_alu_immediate(p, 6, ESI, 0xff);
+            emit_alu(p, ALU_ADD, ECX, EAX);
+            emit_alu(p, ALU_ADD, ECX, ESI);
+            emit_store32(p, field(&cpu.p.carry_result), ECX);
+            emit_alu(p, ALU_XOR, EDX, EAX);
+            emit_alu(p, ALU_XOR, EAX, ECX);
+            emit_alu(p, ALU_AND, EAX, EDX);
+            emit_store8(p, field(&cpu.p.overflow_result), EAX);
+            emit_store8(p, field(&cpu.a), ECX);
+            emit_update_zn(p, ECX);
+        } else {
+            // CMP/CPX/CPY: carry_result = r + (m ^ 0xff) + 1、update_zn(r - m)
+            emit_load8(p, EAX, field(register_field(is_jit_mnemonic(i, "CMP") ? 'A' : i->mnemonic[2])));
+            emit_alu(p, ALU_MOV, ECX, EDX);
+            emit_alu_immediate(p, 6, ECX, 0xff);
+            emit_alu(p, ALU_ADD, ECX, EAX);
+            emit_alu_immediate(p, 0, ECX, 1);
+            emit_store32(p, field(&cpu.p.carry_result), ECX);
+            emit_alu(p, ALU_SUB, EAX, EDX);
+            emit_update_zn(p, EAX);
+        }
+    } else if(is_any_mnemonic(i, jit_write_mnemonic, sizeof(jit_write_mnemonic) / sizeof(char*))) {
+        JIT_Memory memory = emit_ram_address(p, i, operand);
+        if(i->mnemonic[0] == 'S') {
+            // STA/STX/STY
+            emit_load8(p, EAX, field(register_field(i->mnemonic[2])));
+            emit_store8(p, memory, EAX);
+        } else {
+            // INC/DEC (内部RAMへの書き込みは1回だけ)
+            emit_load8(p, EAX, memory);
+            emit_alu_immediate(p, is_jit_mnemonic(i, "INC") ? 0 : 5, EAX, 1);
+            emit_store8(p, memory, EAX);
+            emit_update_zn(p, EAX);
+        }
+    } else if(is_jit_mnemonic(i, "CLC") || is_jit_mnemonic(i, "SEC")) {
+        emit_store32_immediate(p, field(&cpu.p.carry_result), is_jit_mnemonic(i, "SEC") ? 0x100 : 0);
+    } else if(is_jit_mnemonic(i, "NOP")) {
+        return;
+    } else if(i->mnemonic[0] == 'T') {
+        // TAX/TAY/TXA/TYA
+        emit_load8(p, EAX, field(register_field(i->mnemonic[1])));
+        emit_store8(p, field(register_field(i->mnemonic[2])), EAX);
+        emit_update_zn(p, EAX);
+    } else if(i->mnemonic[0] == 'I' || i->mnemonic[0] == 'D') {
+        // INX/INY/DEX/DEY
+        JIT_Memory memory = field(register_field(i->mnemonic[2]));
+        emit_load8(p, EAX, memory);
+        emit_alu_immediate(p, i->mnemonic[0] == 'I' ? 0 : 5, EAX, 1);
+        emit_store8(p, memory, EAX);
+        emit_update_zn(p, EAX);
+    } else {
+        // ASL/LSR/ROL/ROR A
+        emit_load8(p, EAX, field(&cpu.a));
+        if(is_jit_mnemonic(i, "ASL")) {
+            // carry_result = a << 1
+            emit_shift(p, 4, EAX, 1);
+            emit_store32(p, field(&cpu.p.carry_result), EAX);
+        } else if(is_jit_mnemonic(i, "ROL")) {
+            // carry_result = (a << 1) + C
+            emit_load_carry(p);
+            emit_shift(p, 4, EAX, 1);
+            emit_alu(p, ALU_ADD, EAX, ECX);
+            emit_store32(p, field(&cpu.p.carry_result), EAX);
+        } else {
+            // carry_result = (a & 0x01) << 8、RORはビット7に元のC
+            if(is_jit_mnemonic(i, "ROR")) {
+                emit_load_carry(p);
+                emit_shift(p, 4, ECX, 7);
+            }
+            emit_alu(p, ALU_MOV, EDX, EAX);
+            emit_alu_immediate(p, 4, EDX, 0x01);
+            emit_shift(p, 4, EDX, 8);
+            emit_store32(p, field(&cpu.p.carry_result), EDX);
+            emit_shift(p, 5, EAX, 1);
+            if(is_jit_mnemonic(i, "ROR")) {
+                emit_alu(p, ALU_ADD, EAX, ECX);
+            }
+        }
+        emit_store8(p, field(&cpu.a), EAX);
+        emit_update_zn(p, EAX);
+    }
+}
+
+// mov edi, operand / call handler / test al, al / jz exit
+void emit_handler_call(unsigned char **p, Decoded_Instruction *d, unsigned char **exit_jump, int *exit_jump_count) {
+    emit_move_immediate(p, EDI, d->operand);
+    emit_call(p, d->handler);
+    emit8(p, 0x84);
+    emit8(p, 0xc0);
+    exit_jump[(*exit_jump_count)++] = emit_jump_if(p, JUMP_IF_ZERO);
+}
+
+// デコード済みのハンドラに対応するオペコード (スーパー命令の場合は-1)
+int handler_opcode(bool (*handler)(unsigned short)) {
+    for(int opcode = 0; opcode < 256; opcode++) {
+        if(instruction_table[opcode] != NULL && predecoded_handler[opcode] == handler) {
+            return opcode;
+        }
+    }
+    return -1;
+}
+
+void flush_jit(void) {
+    memset(jit_block, 0, sizeof(jit_block));
+    jit_code_used = 0;
+}
+
+// バッファのstartからsizeバイトを含むページの保護を変える
+void protect_jit_code(unsigned char *start, unsigned int size, int protection) {
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    unsigned char *first = jit_code + ((start - jit_code) / page_size) * page_size;
+    unsigned char *last = start + size;
+    if(last > jit_code + JIT_CODE_SIZE) {
+        last = jit_code + JIT_CODE_SIZE;
+    }
+    if(mprotect(first, last - first, protection) != 0) {
+        error("Cannot change protection of JIT code buffer\n");
+    }
+}
+
+// pcから始まるブロックを変換する
+// 生成するコード:
+//     push rbx                          (呼び出し前にスタックを16バイト境界に揃える)
+//     mov rbx, &cpu
+//     連続するネイティブの命令ごとに
+//         mov rax, [cpu_cycle]
+//         add rax, サイクル数の合計
+//         cmp rax, [next_event_cycle]
+//         jae fallback                  (途中でイベントが来る)
+//         cmp rax, [cpu_deadline]
+//         jae fallback                  (途中でcpu_deadlineに達する)
+//         ネイティブのコード
+//         mov edi, サイクル数の合計 / call tick
+//         add word [cpu.pc], バイト数の合計
+//         add dword [instruction_count], 命令数
+//     resume:
+//     ネイティブにできない命令ごとに
+//         mov edi, operand / call handler / test al, al / jz exit
+//     ...
+// exit:
+//     pop rbx
+//     ret
+// fallback:
+//     (同じ命令をハンドラの呼び出しで実行する)
+//     jmp resume
+void (*compile_block(unsigned short pc))(void) {
+    if(jit_code == NULL) {
+        jit_code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(jit_code == MAP_FAILED) {
+            error("Cannot allocate JIT code buffer\n");
+        }
+    }
+    if(JIT_CODE_SIZE - jit_code_used < JIT_BLOCK_CODE_SIZE) {
+        flush_jit();
+    }
+
+    Decoded_Instruction run[JIT_BLOCK_MAX_INSTRUCTION];
+    int count = decode_block(pc, run, JIT_BLOCK_MAX_INSTRUCTION, true);
+    if(count == 0) {
+        return NULL;
+    }
+    unsigned char *start = jit_code + jit_code_used;
+    protect_jit_code(start, JIT_BLOCK_CODE_SIZE, PROT_READ | PROT_WRITE);
+    unsigned char *p = start;
+    unsigned char *exit_jump[2 * JIT_BLOCK_MAX_INSTRUCTION];
+    int exit_jump_count = 0;
+    // 連続するネイティブの命令の範囲 [first, end) と、ハンドラで実行するコードへのジャンプ、戻り先
+    int fallback_first[JIT_BLOCK_MAX_INSTRUCTION], fallback_end[JIT_BLOCK_MAX_INSTRUCTION];
+    unsigned char *fallback_jump[JIT_BLOCK_MAX_INSTRUCTION][2], *fallback_resume[JIT_BLOCK_MAX_INSTRUCTION];
+    int fallback_count = 0;
+
+    emit8(&p, 0x53);
+    emit8(&p, 0x48);
+    emit8(&p, 0xbb);
+    emit64(&p, (unsigned long long)&cpu);
+    for(int index = 0; index < count;) {
+        int opcode = handler_opcode(run[index].handler);
+        Instruction *i = opcode < 0 ? NULL : instruction_table[opcode];
+        if(i == NULL || is_native(i, run[index].operand) == false) {
+            emit_handler_call(&p, run + index, exit_jump, &exit_jump_count);
+            index += 1;
+            continue;
+        }
+        int end = index;
+        unsigned int cycle = 0, length = 0;
+        while(end < count) {
+            opcode = handler_opcode(run[end].handler);
+            i = opcode < 0 ? NULL : instruction_table[opcode];
+            if(i == NULL || is_native(i, run[end].operand) == false) {
+                break;
+            }
+            cycle += i->cycle;
+            length += i->length;
+            end += 1;
+        }
+
+        emit8(&p, 0x48);
+        emit8(&p, 0x8b);
+        emit_memory(&p, EAX, field(&cpu_cycle));
+        emit8(&p, 0x48);
+        emit8(&p, 0x05);
+        emit32(&p, cycle);
+        emit8(&p, 0x48);
+        emit8(&p, 0x3b);
+        emit_memory(&p, EAX, field(&next_event_cycle));
+        fallback_jump[fallback_count][0] = emit_jump_if(&p, JUMP_IF_ABOVE_OR_EQUAL);
+        emit8(&p, 0x48);
+        emit8(&p, 0x3b);
+        emit_memory(&p, EAX, field(&cpu_deadline));
+        fallback_jump[fallback_count][1] = emit_jump_if(&p, JUMP_IF_ABOVE_OR_EQUAL);
+        for(int native = index; native < end; native++) {
+            emit_native(&p, instruction_table[handler_opcode(run[native].handler)], run[native].operand);
+        }
+        emit_move_immediate(&p, EDI, cycle);
+        emit_call(&p, tick);
+        // add word [cpu.pc], length
+        emit8(&p, 0x66);
+        emit8(&p, 0x81);
+        emit_memory(&p, 0, field(&cpu.pc));
+        emit16(&p, length);
+        // add dword [instruction_count], end - index
+        emit8(&p, 0x81);
+        emit_memory(&p, 0, field(&instruction_count));
+        emit32(&p, end - index);
+        fallback_first[fallback_count] = index;
+        fallback_end[fallback_count] = end;
+        fallback_resume[fallback_count] = p;
+        fallback_count += 1;
+        index = end;
+    }
+    unsigned char *exit = p;
+    emit8(&p, 0x5b);
+    emit8(&p, 0xc3);
+    for(int k = 0; k < fallback_count; k++) {
+        patch_jump(fallback_jump[k][0], p);
+        patch_jump(fallback_jump[k][1], p);
+        for(int index = fallback_first[k]; index < fallback_end[k]; index++) {
+            emit_handler_call(&p, run + index, exit_jump, &exit_jump_count);
+        }
+        patch_jump(emit_jump_always(&p), fallback_resume[k]);
+    }
+    for(int k = 0; k < exit_jump_count; k++) {
+        patch_jump(exit_jump[k], exit);
+    }
+    protect_jit_code(start, JIT_BLOCK_CODE_SIZE, PROT_READ | PROT_EXEC);
+
+    jit_code_used += p - start;
+    jit_compiled_count += 1;
+    return (void (*)(void))start;
+}
+
+// 変換済みのブロックがあれば実行してtrueを返す
+// まだ変換しない場合はfalseを返し、呼び出し側がインタプリタで1命令実行する
+bool run_jit_block(void) {
+    if(cpu.pc < 0x8000) {
+        return false;
+    }
+    JIT_Block *block = jit_block + (cpu.pc - 0x8000);
+    unsigned char *bank = read_page[cpu.pc >> PAGE_SHIFT];
+    if(block->bank != bank) {
+        block->bank = bank;
+        block->code = NULL;
+        block->count = 0;
+        block->uncompilable = false;
+    }
+    if(block->code == NULL) {
+        if(block->uncompilable || ++block->count < JIT_THRESHOLD) {
+            return false;
+        }
+        block->code = compile_block(cpu.pc);
+        // compile_blockがキャッシュを破棄した場合に備えて設定し直す
+        block->bank = bank;
+        if(block->code == NULL) {
+            block->uncompilable = true;
+            return false;
+        }
+    }
+    block->code();
+    return true;
+}
+
+// run_cyclesと同じ条件で停止する
+unsigned int run_cycles_jit(unsigned int budget) {
+#if defined(__x86_64__)
+    unsigned long long start_cycle = begin_run(budget);
+    while(cpu_cycle < cpu_deadline || continue_run()) {
+        if(run_jit_block() == false) {
+            step_nes();
+        }
+    }
+    return cpu_cycle - start_cycle;
+#else
+    error("JIT is only supported on x86-64\n");
+    return 0;
+#endif
+}
@@ -0,0 +1,236 @@
+// nftwを使う
+#define _GNU_SOURCE
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+// ROMライブラリの索引
+// ディレクトリ以下の.nesと.nes.gzを探し、ヘッダの情報とPRG/CHRのCRC32をディレクトリのindex.txtに保存する
+// - 索引にあるファイルは、更新日時と大きさが変わっていなければ読み直さない
+// - 読み直すファイルは、CPUの数のスレッドで分担してハッシュを計算する
+// - 索引の1行が1つのROM (タブ区切り、パスが最後)
+//     更新日時(ナノ秒) 大きさ CRC32 マッパー サブマッパー ミラーリング PRG-ROM CHR-ROM バッテリー 有効 パス
+
+#define LIBRARY_INDEX_FILE "index.txt"
+#define LIBRARY_INDEX_VERSION "# memu library index 2"
+#define LIBRARY_THREAD_MAX (64)
+
+unsigned char *map_rom_file(char *file_name, unsigned int *size);
+char *parse_header(ROM *rom);
+Header_Database *load_header_database(void);
+void free_header_database(Header_Database *database);
+void correct_header(ROM *rom, Header_Database *database, unsigned int crc);
+bool is_supported_mapper(unsigned int number);
+
+// main.cのライブラリ画面から参照する (update_libraryが入れ替えるので、参照中はlibrary_lockを取る)
+Library_Entry *library;
+int library_count;
+pthread_mutex_t library_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 走査中のエントリ (nftwのコールバックに引数を渡せないので大域変数にする、update_libraryは同時に1つしか実行しない)
+Library_Entry *scanned;
+int scanned_count, scanned_capacity;
+Library_Entry *indexed;
+int indexed_count;
+int next_job;
+// 走査のたびに1回だけ読み込み、スレッドは読み込むだけ
+Header_Database *header_database;
+
+int compare_entry(const void *a, const void *b) {
+    return strcmp(((Library_Entry*)a)->path, ((Library_Entry*)b)->path);
+}
+
+bool has_suffix(const char *s, const char *suffix) {
+    size_t length = strlen(s), suffix_length = strlen(suffix);
+    return length >= suffix_length && strcasecmp(s + length - suffix_length, suffix) == 0;
+}
+
+void free_entries(Library_Entry *entry, int count) {
+    for(int i = 0; i < count; i++) {
+        free(entry[i].path);
+    }
+    free(entry);
+}
+
+// 索引ファイルを読み込む (ファイルがない場合や形式が違う場合は空)
+Library_Entry *load_index(char *index_file, int *count) {
+    *count = 0;
+    FILE *fp = fopen(index_file, "r");
+    if(fp == NULL) {
+        return NULL;
+    }
+    int capacity = 0;
+    Library_Entry *entry = NULL;
+    char line[4096];
+    if(fgets(line, sizeof(line), fp) == NULL || strncmp(line, LIBRARY_INDEX_VERSION, strlen(LIBRARY_INDEX_VERSION)) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        Library_Entry e = {0};
+        int battery, valid, offset;
+        line[strcspn(line, "\n")] = '\0';
+        if(sscanf(line, "%lld\t%lld\t%x\t%u\t%u\t%u\t%u\t%u\t%d\t%d\t%n", &e.mtime, &e.size, &e.crc, &e.mapper, &e.submapper, &e.mirroring,
+                  &e.program_rom_size, &e.character_rom_size, &battery, &valid, &offset) != 10) {
+            continue;
+        }
+        e.has_battery = battery != 0;
+        e.valid = valid != 0;
+        e.path = strdup(line + offset);
+        if(*count == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            entry = realloc(entry, sizeof(Library_Entry) * capacity);
+        }
+        entry[(*count)++] = e;
+    }
+    fclose(fp);
+    // 保存時にパスの順に並べているが、手で編集された場合に備えて並べ直す
+    qsort(entry, *count, sizeof(Library_Entry), compare_entry);
+    return entry;
+}
+
+// 一時ファイルに書いてから置き換えるので、途中で終了しても古い索引が残る
+void save_index(char *index_file, Library_Entry *entry, int count) {
+    char temporary_file[4096];
+    snprintf(temporary_file, sizeof(temporary_file), "%s.tmp", index_file);
+    FILE *fp = fopen(temporary_file, "w");
+    if(fp == NULL) {
+        return;
+    }
+    fprintf(fp, "%s\n", LIBRARY_INDEX_VERSION);
+    for(int i = 0; i < count; i++) {
+        Library_Entry *e = entry + i;
+        fprintf(fp, "%lld\t%lld\t%08x\t%u\t%u\t%u\t%u\t%u\t%d\t%d\t%s\n", e->mtime, e->size, e->crc, e->mapper, e->submapper, e->mirroring,
+                e->program_rom_size, e->character_rom_size, e->has_battery, e->valid, e->path);
+    }
+    fclose(fp);
+    rename(temporary_file, index_file);
+}
+
+int scan_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    // パスにタブや改行を含むファイルは索引に書けないので無視する
+    if(type != FTW_F || (has_suffix(path, ".nes") == false && has_suffix(path, ".nes.gz") == false) || strpbrk(path, "\t\n") != NULL) {
+        return 0;
+    }
+    if(scanned_count == scanned_capacity) {
+        scanned_capacity = scanned_capacity == 0 ? 1024 : scanned_capacity * 2;
+        scanned = realloc(scanned, sizeof(Library_Entry) * scanned_capacity);
+    }
+    Library_Entry *e = scanned + scanned_count++;
+    memset(e, 0, sizeof(Library_Entry));
+    e->path = strdup(path);
+    e->mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    e->size = st->st_size;
+    // 前回の索引と更新日時と大きさが同じなら、前回の結果を使う
+    Library_Entry *old = bsearch(e, indexed, indexed_count, sizeof(Library_Entry), compare_entry);
+    if(old != NULL && old->mtime == e->mtime && old->size == e->size) {
+        char *path = e->path;
+        *e = *old;
+        e->path = path;
+    } else {
+        e->stale = true;
+    }
+    return 0;
+}
+
+void index_rom(Library_Entry *e) {
+    ROM rom;
+    e->stale = false;
+    e->valid = false;
+    rom.rom = map_rom_file(e->path, &rom.rom_size);
+    if(rom.rom == NULL) {
+        return;
+    }
+    if(parse_header(&rom) == NULL) {
+        e->crc = crc32(0, rom.program_rom, rom.program_rom_size + rom.character_rom_size);
+        correct_header(&rom, header_database, e->crc);
+        e->mapper = rom.mapper;
+        e->submapper = rom.submapper;
+        e->mirroring = rom.mirroring;
+        e->program_rom_size = rom.program_rom_size;
+        e->character_rom_size = rom.character_rom_size;
+        e->has_battery = rom.has_battery;
+        e->valid = is_supported_mapper(rom.mapper);
+    }
+    munmap(rom.rom, rom.rom_size);
+}
+
+void *index_worker(void *argument) {
+    while(true) {
+        int i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+        if(i >= scanned_count) {
+            return NULL;
+        }
+        if(scanned[i].stale) {
+            index_rom(scanned + i);
+        }
+    }
+}
+
+void set_library(Library_Entry *entry, int count) {
+    pthread_mutex_lock(&library_lock);
+    Library_Entry *old_library = library;
+    int old_library_count = library_count;
+    library = entry;
+    library_count = count;
+    pthread_mutex_unlock(&library_lock);
+    free_entries(old_library, old_library_count);
+}
+
+// 前回保存した索引をそのままlibraryにする (起動時にディレクトリを走査せずに一覧を表示する)
+void load_library(char *directory) {
+    char index_file[4096];
+    snprintf(index_file, sizeof(index_file), "%s/%s", directory, LIBRARY_INDEX_FILE);
+    int count;
+    Library_Entry *entry = load_index(index_file, &count);
+    set_library(entry, count);
+}
+
+// directory以下を走査して索引を更新し、libraryを入れ替える
+// 読み直したファイル数を返す
+int update_library(char *directory) {
+    char index_file[4096];
+    snprintf(index_file, sizeof(index_file), "%s/%s", directory, LIBRARY_INDEX_FILE);
+    indexed = load_index(index_file, &indexed_count);
+    scanned = NULL;
+    scanned_count = scanned_capacity = 0;
+    nftw(directory, scan_file, 64, FTW_PHYS);
+
+    int stale_count = 0;
+    for(int i = 0; i < scanned_count; i++) {
+        stale_count += scanned[i].stale;
+    }
+    header_database = load_header_database();
+    int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if(thread_count > LIBRARY_THREAD_MAX) {
+        thread_count = LIBRARY_THREAD_MAX;
+    }
+    if(thread_count > stale_count) {
+        thread_count = stale_count;
+    }
+    pthread_t thread[LIBRARY_THREAD_MAX];
+    next_job = 0;
+    for(int i = 0; i < thread_count; i++) {
+        pthread_create(thread + i, NULL, index_worker, NULL);
+    }
+    for(int i = 0; i < thread_count; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    free_header_database(header_database);
+
+    qsort(scanned, scanned_count, sizeof(Library_Entry), compare_entry);
+    if(stale_count > 0 || scanned_count != indexed_count) {
+        save_index(index_file, scanned, scanned_count);
+    }
+    free_entries(indexed, indexed_count);
+    set_library(scanned, scanned_count);
+    return stale_count;
+}
@@ -1,6 +1,7 @@
 #include "common.h"
 #include <gtk-3.0/gtk/gtk.h>
 #include <SDL2/SDL.h>
+#include <pthread.h>
 
 // ***** チラつき問題 *****
 // 行ごとに背景タイルを表示するのがチラつきの原因だが、一括表示では分割スクロールができない
@@ -10,6 +11,7 @@
 // start 0 | 246 1
 // 26 1    | start 0
 // end 151 | end 152
+// => 背景はスキャンラインごとにPPU内部のv/tから描画するようにしたので、途中で書き込んだスクロールは次の行から反映される
 // color_test.nesでは、ネームテーブルの変更が無い場合でもスプライトがチラつく
 
 // color_test.nes: スプライト非表示が正しく処理されない
@@ -18,17 +20,31 @@
 // テストROMに挑戦する (https://github.com/christopherpow/nes-test-roms)
 // 8*16モードの垂直反転はタイルの交換である (8*16モードでは、oam_dataのバイト1を使用してパターンテーブルを探す)
 // スプライトレンダリングをスキャンライン毎に行うとキノコが正しく出現するかも (behind_backgroundの処理を忘れずに)
+// => スプライトはスキャンライン毎に描画し、behind_backgroundは背景の不透明なピクセルのマスクで判定するようにした
 
 #define FPS (60)
+#define ROM_DIRECTORY "./rom"
 
 int draw_count;
 GtkWidget *drawing_area;
 unsigned char frame[BYTE_PER_PIXEL * SCREEN_PIXEL_WIDTH * SCREEN_PIXEL_HEIGHT];
 
 extern unsigned char button_status;
+extern unsigned int instruction_count;
+extern unsigned int frame_count;
+extern unsigned int skipped_frame_count;
 
 void init_nes(char *file_name);
 gboolean run_nes(gpointer data);
+void recompile(char *rom_file, char *output_file);
+void load_library(char *directory);
+int update_library(char *directory);
+void present_frame(void);
+void bench_mapper(void);
+
+extern Library_Entry *library;
+extern int library_count;
+extern pthread_mutex_t library_lock;
 
 void error(char *message, ...) {
     va_list argument;
@@ -38,18 +54,73 @@ void error(char *message, ...) {
     exit(EXIT_FAILURE);
 }
 
+void open_rom(char *file_name) {
+    static guint id;
+    if(id) g_source_remove(id);
+    SDL_CloseAudio();
+    init_nes(file_name);
+    id = g_idle_add(run_nes, NULL);
+}
+
 void open_file(GtkWidget *widget, gpointer data) {
     GtkWidget *dialog = gtk_file_chooser_dialog_new("Open File", GTK_WINDOW(data), GTK_FILE_CHOOSER_ACTION_OPEN, \
                                                     "_Open", GTK_RESPONSE_ACCEPT, "_Cancel", GTK_RESPONSE_CANCEL, NULL);
-    gtk_file_chooser_set_current_folder(GTK_FILE_CHOOSER(dialog), "./rom");
+    gtk_file_chooser_set_current_folder(GTK_FILE_CHOOSER(dialog), ROM_DIRECTORY);
     if(gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
-        static guint id;
-        if(id) g_source_remove(id);
-        SDL_CloseAudio();
-        init_nes(gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog)));
-        id = g_idle_add(run_nes, NULL);
+        open_rom(gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog)));
+    }
+    gtk_widget_destroy(dialog);
+}
+
+// ライブラリの一覧 (起動時に読み込んだ索引か、バックグラウンドで更新した索引を表示する)
+void open_library(GtkWidget *widget, gpointer data) {
+    static char *mirroring[] = {"H", "V", "4", "1L", "1H"};
+    GtkListStore *store = gtk_list_store_new(7, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_STRING);
+    pthread_mutex_lock(&library_lock);
+    for(int i = 0; i < library_count; i++) {
+        Library_Entry *e = library + i;
+        char crc[16];
+        sprintf(crc, "%08X", e->crc);
+        GtkTreeIter iter;
+        gtk_list_store_append(store, &iter);
+        gtk_list_store_set(store, &iter, 0, e->path + strlen(ROM_DIRECTORY) + 1, 1, e->mapper, 2, e->mirroring < 5 ? mirroring[e->mirroring] : "?",
+                           3, e->program_rom_size / 1024, 4, e->character_rom_size / 1024, 5, crc, 6, e->valid ? "" : "unsupported", -1);
+    }
+    pthread_mutex_unlock(&library_lock);
+
+    GtkWidget *dialog = gtk_dialog_new_with_buttons("Library", GTK_WINDOW(data), GTK_DIALOG_MODAL, \
+                                                    "_Open", GTK_RESPONSE_ACCEPT, "_Cancel", GTK_RESPONSE_CANCEL, NULL);
+    GtkWidget *view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
+    char *title[] = {"File", "Mapper", "Mirroring", "PRG KB", "CHR KB", "CRC32", ""};
+    for(int i = 0; i < 7; i++) {
+        GtkTreeViewColumn *column = gtk_tree_view_column_new_with_attributes(title[i], gtk_cell_renderer_text_new(), "text", i, NULL);
+        gtk_tree_view_column_set_sort_column_id(column, i);
+        gtk_tree_view_append_column(GTK_TREE_VIEW(view), column);
+    }
+    gtk_tree_view_set_search_column(GTK_TREE_VIEW(view), 0);
+    GtkWidget *scroll = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_size_request(scroll, 640, 480);
+    gtk_container_add(GTK_CONTAINER(scroll), view);
+    gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(dialog))), scroll, TRUE, TRUE, 0);
+    g_signal_connect_swapped(view, "row-activated", G_CALLBACK(gtk_window_activate_default), dialog);
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_ACCEPT);
+    gtk_widget_show_all(dialog);
+
+    GtkTreeIter iter;
+    GtkTreeModel *model;
+    if(gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT && gtk_tree_selection_get_selected(gtk_tree_view_get_selection(GTK_TREE_VIEW(view)), &model, &iter)) {
+        char *file;
+        gtk_tree_model_get(model, &iter, 0, &file, -1);
+        open_rom(g_strdup_printf("%s/%s", ROM_DIRECTORY, file));
+        g_free(file);
     }
     gtk_widget_destroy(dialog);
+    g_object_unref(store);
+}
+
+gpointer update_library_thread(gpointer data) {
+    update_library(ROM_DIRECTORY);
+    return NULL;
 }
 
 gboolean key_press(GtkWidget *widget, GdkEventKey *event, gpointer data) {
@@ -117,10 +188,17 @@ gboolean key_release(GtkWidget *widget, GdkEventKey *event, gpointer data) {
 
 gboolean draw(GtkWidget *widget, cairo_t *cairo, gpointer data) {
     draw_count += 1;
+    present_frame();
     cairo_surface_t *surface = cairo_image_surface_create_for_data(frame, CAIRO_FORMAT_RGB24, SCREEN_PIXEL_WIDTH, SCREEN_PIXEL_HEIGHT, BYTE_PER_PIXEL * SCREEN_PIXEL_WIDTH);
     cairo_set_source_surface(cairo, surface, 0, 0);
     cairo_paint(cairo);
     cairo_surface_destroy(surface);
+    return TRUE;
+}
+
+// エミュレートした1フレームごとにrun_nesから呼び、FPSの間隔になるまで待つ
+// 前のフレームと同じで描画を省いたフレームも待つので、静止画面でもゲーム内の時間と音声は速くならない
+void wait_next_frame(void) {
     struct timespec current_time;
     static struct timespec last_time;
     clock_gettime(CLOCK_MONOTONIC, &current_time);
@@ -130,25 +208,54 @@ gboolean draw(GtkWidget *widget, cairo_t *cairo, gpointer data) {
         nanosleep(&request_time, NULL);
     }
     clock_gettime(CLOCK_MONOTONIC, &last_time);
-    return TRUE;
 }
 
+// エミュレートしたフレーム数 (前のフレームと同じで描画を省いたフレームを含む) と、実際に描画した回数を表示する
 gboolean show_fps(gpointer data) {
+    static unsigned int previous_emulated_count;
+    unsigned int emulated_count = frame_count + skipped_frame_count;
     char s[256];
-    sprintf(s, "MEMU [%d]", draw_count);
+    sprintf(s, "MEMU [%u] [%d drawn] [%.2f MIPS]", emulated_count - previous_emulated_count, draw_count, instruction_count / 1000000.0);
+    previous_emulated_count = emulated_count;
     gtk_window_set_title(GTK_WINDOW(data), s);
     draw_count = 0;
+    instruction_count = 0;
     return G_SOURCE_CONTINUE;
 }
 
 int main(int argc, char **argv) {
+    // ./memu --aot rom/game.nes aot/game.c
+    if(argc == 4 && strcmp(argv[1], "--aot") == 0) {
+        recompile(argv[2], argv[3]);
+        return 0;
+    }
+    // ./memu --index [rom]
+    if((argc == 2 || argc == 3) && strcmp(argv[1], "--index") == 0) {
+        char *directory = argc == 3 ? argv[2] : ROM_DIRECTORY;
+        int stale_count = update_library(directory);
+        int valid_count = 0;
+        for(int i = 0; i < library_count; i++) {
+            valid_count += library[i].valid;
+        }
+        printf("%d ROMs (%d indexed, %d supported)\n", library_count, stale_count, valid_count);
+        return 0;
+    }
+
+    // ./memu --bench-mapper
+    if(argc == 2 && strcmp(argv[1], "--bench-mapper") == 0) {
+        bench_mapper();
+        return 0;
+    }
+
     gtk_init(&argc, &argv);
     SDL_Init(SDL_INIT_AUDIO);
 
     GtkWidget *menu_bar = gtk_menu_bar_new();
     GtkWidget *open_menu_item = gtk_menu_item_new_with_label("Open");
+    GtkWidget *library_menu_item = gtk_menu_item_new_with_label("Library");
     GtkWidget *exit_menu_item = gtk_menu_item_new_with_label("Exit");
     gtk_menu_shell_append(GTK_MENU_SHELL(menu_bar), open_menu_item);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menu_bar), library_menu_item);
     gtk_menu_shell_append(GTK_MENU_SHELL(menu_bar), exit_menu_item);
 
     drawing_area = gtk_drawing_area_new();
@@ -165,6 +272,7 @@ int main(int argc, char **argv) {
     gtk_container_add(GTK_CONTAINER(window), box);
 
     g_signal_connect(open_menu_item, "activate", G_CALLBACK(open_file), window);
+    g_signal_connect(library_menu_item, "activate", G_CALLBACK(open_library), window);
     g_signal_connect(exit_menu_item, "activate", G_CALLBACK(gtk_main_quit), NULL);
     g_signal_connect(drawing_area, "draw", G_CALLBACK(draw), NULL);
     g_signal_connect(window, "key-press-event", G_CALLBACK(key_press), NULL);
@@ -172,6 +280,10 @@ int main(int argc, char **argv) {
     g_signal_connect(window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
     g_timeout_add(1000, show_fps, window);
 
+    // 前回の索引をすぐに表示できるようにしてから、ディレクトリの変更をバックグラウンドで反映する
+    load_library(ROM_DIRECTORY);
+    g_thread_unref(g_thread_new("library", update_library_thread, NULL));
+
     gtk_widget_show_all(window);
     gtk_main();
     return 0;
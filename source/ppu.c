@@ -1,45 +1,105 @@
 #include "common.h"
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <gtk-3.0/gtk/gtk.h>
 
 #define between(start, address, end) (start <= address && address <= end)
-#define MIRROR_HORIZONTAL (0)
-#define MIRROR_VERTICAL (1)
 #define TILE_PIXEL_SIZE (8)
 #define TILE_NUMBER_X (32)
 #define TILE_NUMBER_Y (30)
 #define PATTERN_BYTE_SIZE (16)
 #define PATTERN_TABLE_BYTE_SIZE (PATTERN_BYTE_SIZE * 256)
 
+// 描画を省略したフレームの数を表示する
+// #define SKIPPED_FRAME_STATS
+
 extern ROM *rom;
-extern unsigned char frame[BYTE_PER_PIXEL * SCREEN_PIXEL_WIDTH * SCREEN_PIXEL_HEIGHT];
 extern GtkWidget *drawing_area;
 
-void nmi(void);
-
-// 0x2005と0x2006で共有されるアドレスラッチ
+void raise_nmi(void);
+void interrupt_run(void);
+void init_tile_cache(void);
+Decoded_Tile *decode_tile(unsigned char *pattern, bool flip_horizontal);
+void invalidate_tile(unsigned char *address);
+void finish_tile_frame(void);
+extern void (*compose_line)(unsigned char *out, unsigned char *index, unsigned char *palette);
+extern void (*compose_sprite_row)(unsigned char *out, unsigned char *pixel, unsigned char *palette, unsigned int mask, int count);
+
+// PPU内部のスクロールレジスタ (0x2000、0x2005、0x2006で設定する)
+// vとtのビット配置: yyy NN YYYYY XXXXX (細かいyスクロール、ネームテーブル、coarse Y、coarse X)
+// v: 描画中のVRAMアドレス (0x2007の読み書きにも使う)
+// t: 一時VRAMアドレス (描画開始時と各可視スキャンラインのドット256にvへコピーされる)
+// fine_x: 細かいxスクロール (3ビット)
+// w: 0x2005と0x2006で共有されるアドレスラッチ
+unsigned short v, t;
+unsigned char fine_x;
 bool w;
 
 unsigned int ppu_cycle, scanline;
-unsigned char nametable[0x800];
-unsigned char *nametable_top_left, *nametable_top_right, *nametable_bottom_left, *nametable_bottom_right;
+// 241行目に到達するとセットされる (run_cyclesのフレーム区切り、次の命令境界で実行を止める)
+bool frame_ready;
+// 描画したフレーム数 (video.cが新しいフレームかどうかの判定に使う)
+unsigned int frame_count;
+// 4画面ミラーリング用に4KBを確保する (それ以外のミラーリングでは先頭の2KBだけを使う)
+unsigned char nametable[0x1000];
 unsigned char palette_table[0x20];
+// OAMかスプライトの大きさが変わり、スキャンラインごとのスプライトの一覧を作り直す必要がある
+bool sprite_bucket_dirty = true;
+
+// PPUのページテーブル (0x0000-0x3fffを1KBごと)
+// パターンテーブルの8ページはマッパーがmap_chrで、ネームテーブルの4ページはset_mirroringで割り当てる
+// 0x3000-0x3fffはネームテーブルのミラー (0x3f00以降のパレットはページテーブルを通さない)
+// ppu_write_pageがNULLのページ(CHR-ROM)への書き込みは無視する
+unsigned char *ppu_read_page[PPU_PAGE_COUNT];
+unsigned char *ppu_write_page[PPU_PAGE_COUNT];
+
+// 描画結果 (1ピクセル1バイトで、パレットの値(NESの色番号)を書く)
+// RGBへの変換と拡大はvideo.cのpresent_frameが表示する時に行う
+unsigned char screen[SCREEN_BLOCK_WIDTH * SCREEN_BLOCK_HEIGHT];
+
+// 変化のないフレームの検出
+// 各スキャンラインの描画結果は、描画開始時(261行目の終わり)のPPUの状態と、それまでの描画中(0-239行目)の変更で決まる
+// - 描画開始時のレジスタ、ページテーブル、memory_serialから署名を作り、描画中のレジスタやバンクの変更を行番号と一緒に混ぜていく
+// - ネームテーブル、パレット、OAM、CHR-RAMの値を変える書き込みはmemory_serialを進める (同じ値の書き込みは無視する)
+// - スキャンラインを描画するドット256の署名が前のフレームの同じ行と同じなら、screenにある前のフレームの行をそのまま使い、描画を省略する
+// すべての行が前のフレームと同じフレームは、表示も更新しない
+unsigned long long signature;
+unsigned long long line_signature[SCREEN_BLOCK_HEIGHT];
+unsigned long long memory_serial = 1;
+// 前のフレームとこのフレームでスプライトゼロヒットがセットされたスキャンライン (ない場合は-1)
+int previous_sprite0_hit_line = -1;
+int sprite0_hit_line = -1;
+// このフレームで描画し直したスキャンライン数
+unsigned int changed_line_count;
+// 描画と表示を省略したフレーム数
+unsigned int skipped_frame_count;
+// MMC3のスキャンラインカウンタが進む点(描画が有効な0-239行目と261行目のドット260)を過ぎた回数
+unsigned int scanline_clock_count;
+
+void mix_signature(unsigned long long value) {
+    signature = (signature ^ value) * 0x100000001b3ULL;
+}
+
+// 描画中のレジスタへの書き込みやバンクの切り替え (registerは種類を区別する番号)
+void sign_register(unsigned int register_number, unsigned long long value) {
+    if(scanline < SCREEN_BLOCK_HEIGHT) {
+        mix_signature(((unsigned long long)scanline << 8) | register_number);
+        mix_signature(value);
+    }
+}
+
+// ネームテーブル、パレット、OAM、CHR-RAMの内容が変わった
+void change_memory(void) {
+    memory_serial += 1;
+    if(scanline < SCREEN_BLOCK_HEIGHT) {
+        mix_signature(memory_serial);
+    }
+}
 
-unsigned char color[] = {
-    0x80, 0x80, 0x80, 0xA6, 0x3D, 0x00, 0xB0, 0x12, 0x00, 0x96, 0x00, 0x44, 0x5E, 0x00, 0xA1,
-    0x28, 0x00, 0xC7, 0x00, 0x06, 0xBA, 0x00, 0x17, 0x8C, 0x00, 0x2F, 0x5C, 0x00, 0x45, 0x10,
-    0x00, 0x4A, 0x05, 0x2E, 0x47, 0x00, 0x66, 0x41, 0x00, 0x00, 0x00, 0x00, 0x05, 0x05, 0x05,
-    0x05, 0x05, 0x05, 0xC7, 0xC7, 0xC7, 0xFF, 0x77, 0x00, 0xFF, 0x55, 0x21, 0xFA, 0x37, 0x82,
-    0xB5, 0x2F, 0xEB, 0x50, 0x29, 0xFF, 0x00, 0x22, 0xFF, 0x00, 0x32, 0xD6, 0x00, 0x62, 0xC4,
-    0x00, 0x80, 0x35, 0x00, 0x8F, 0x05, 0x55, 0x8A, 0x00, 0xCC, 0x99, 0x00, 0x21, 0x21, 0x21,
-    0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xD7, 0x0F, 0xFF, 0xA2, 0x69,
-    0xFF, 0x80, 0xD4, 0xF3, 0x45, 0xFF, 0x8B, 0x61, 0xFF, 0x33, 0x88, 0xFF, 0x12, 0x9C, 0xFF,
-    0x20, 0xBC, 0xFA, 0x0E, 0xE3, 0x9F, 0x35, 0xF0, 0x2B, 0xA4, 0xF0, 0x0C, 0xFF, 0xFB, 0x05,
-    0x5E, 0x5E, 0x5E, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFC, 0xA6,
-    0xFF, 0xEC, 0xB3, 0xEB, 0xAB, 0xDA, 0xF9, 0xA8, 0xFF, 0xB3, 0xAB, 0xFF, 0xB0, 0xD2, 0xFF,
-    0xA6, 0xEF, 0xFF, 0x9C, 0xF7, 0xFF, 0x95, 0xE8, 0xD7, 0xAF, 0xED, 0xA6, 0xDA, 0xF2, 0xA2,
-    0xFC, 0xFF, 0x99, 0xDD, 0xDD, 0xDD, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11
-};
+// 現在のスキャンラインで背景が不透明なピクセル (ビットxがx番目のピクセル)
+// スプライトの優先度とスプライトゼロヒットの判定に使う (最後の要素は右端をまたいで8ビットを読むための余白)
+unsigned long long background_opaque[SCREEN_BLOCK_WIDTH / 64 + 1];
 
 // 0x2000 (Write)
 typedef struct {
@@ -82,6 +142,7 @@ void write_ppu_mask(unsigned char value) {
     ppu_mask.render_leftmost_sprite = (value >> 2) & 0x01;
     ppu_mask.render_background = (value >> 3) & 0x01;
     ppu_mask.render_sprite = (value >> 4) & 0x01;
+    sign_register(1, value);
 }
 
 // 0x2002 (Read)
@@ -98,57 +159,65 @@ typedef struct {
 
 PPU_Status ppu_status;
 
-// 表示する方法として4つの領域に分けているが、実際の読み書きにはnametable_top_leftなどは使わないこと
-void set_nametable(void) {
-    if(rom->mirroring == MIRROR_HORIZONTAL) {
-        switch(ppu_control.base_nametable_address) {
-            case 0: case 1:
-                nametable_top_left = nametable_top_right = nametable;
-                nametable_bottom_left = nametable_bottom_right = nametable + 0x400;
-                break;
-            case 2: case 3:
-                nametable_top_left = nametable_top_right = nametable + 0x400;
-                nametable_bottom_left = nametable_bottom_right = nametable;
-                break;
-        }
-    } else if(rom->mirroring == MIRROR_VERTICAL) {
-        switch(ppu_control.base_nametable_address) {
-            case 0: case 2:
-                nametable_top_left = nametable_bottom_left = nametable;
-                nametable_top_right = nametable_bottom_right = nametable + 0x400;
-                break;
-            case 1: case 3:
-                nametable_top_left = nametable_bottom_left = nametable + 0x400;
-                nametable_top_right = nametable_bottom_right = nametable;
-                break;
-        }
-    } else {
-        error("Unsupported mirroring\n");
+// addressからsizeバイトのパターンテーブルをbankに割り当てる (マッパーがCHRバンクを切り替える時に呼ぶ)
+void map_chr(unsigned short address, unsigned char *bank, unsigned int size) {
+    for(unsigned int i = 0; i < (size >> PAGE_SHIFT); i++) {
+        ppu_read_page[(address >> PAGE_SHIFT) + i] = bank + (i << PAGE_SHIFT);
+        ppu_write_page[(address >> PAGE_SHIFT) + i] = rom->has_character_ram ? bank + (i << PAGE_SHIFT) : NULL;
+    }
+    sign_register(0x10 + (address >> PAGE_SHIFT), (unsigned long long)bank);
+}
+
+// 0x2000-0x2fffの4つのネームテーブルに、内部の1KBのどれを割り当てるか
+void set_mirroring(unsigned int mirroring) {
+    static unsigned char layout[][4] = {
+        [MIRROR_HORIZONTAL] = {0, 0, 1, 1},
+        [MIRROR_VERTICAL] = {0, 1, 0, 1},
+        [MIRROR_FOUR_SCREEN] = {0, 1, 2, 3},
+        [MIRROR_SINGLE_LOW] = {0, 0, 0, 0},
+        [MIRROR_SINGLE_HIGH] = {1, 1, 1, 1}
+    };
+    for(int i = 0; i < 4; i++) {
+        ppu_read_page[(0x2000 >> PAGE_SHIFT) + i] = ppu_write_page[(0x2000 >> PAGE_SHIFT) + i] = nametable + (layout[mirroring][i] << PAGE_SHIFT);
+        ppu_read_page[(0x3000 >> PAGE_SHIFT) + i] = ppu_write_page[(0x3000 >> PAGE_SHIFT) + i] = nametable + (layout[mirroring][i] << PAGE_SHIFT);
     }
+    sign_register(0x20, mirroring);
+}
+
+// PPUのアドレスに対応するホストのメモリ (パターンテーブルとネームテーブルのみ)
+unsigned char *ppu_pointer(unsigned short address) {
+    return ppu_read_page[(address >> PAGE_SHIFT) & (PPU_PAGE_COUNT - 1)] + (address & (PAGE_SIZE - 1));
 }
 
 void write_ppu_control(unsigned char value) {
-    unsigned int old_base_nametable_address = ppu_control.base_nametable_address;
     bool old_generate_nmi = ppu_control.generate_nmi;
     ppu_control.base_nametable_address = (value >> 0) & 0x03;
     ppu_control.increment_address = (value >> 2) & 0x01;
     ppu_control.sprite_pattern_table_address = (value >> 3) & 0x01;
     ppu_control.background_pattern_table_address = (value >> 4) & 0x01;
+    if(ppu_control.sprite_size != ((value >> 5) & 0x01)) {
+        sprite_bucket_dirty = true;
+    }
     ppu_control.sprite_size = (value >> 5) & 0x01;
     ppu_control.generate_nmi = (value >> 7) & 0x01;
-    if(old_base_nametable_address != ppu_control.base_nametable_address) {
-        set_nametable();
-    }
+    t = (t & ~0x0c00) | (ppu_control.base_nametable_address << 10);
+    sign_register(0, value);
     if(old_generate_nmi == false && ppu_control.generate_nmi == true && ppu_status.in_vblank == true) {
-        nmi();
+        raise_nmi();
     }
 }
 
-unsigned char read_ppu_status(void) {
+// 副作用なしでステータスを読む (アイドルループの検出用)
+unsigned char peek_ppu_status(void) {
     unsigned char value = 0;
     if(ppu_status.sprite_overflow) value |= 0x20;
     if(ppu_status.sprite0_hit) value |= 0x40;
     if(ppu_status.in_vblank) value |= 0x80;
+    return value;
+}
+
+unsigned char read_ppu_status(void) {
+    unsigned char value = peek_ppu_status();
     ppu_status.in_vblank = w = false;
     return value;
 }
@@ -168,31 +237,50 @@ unsigned char read_oam_data(void) {
 }
 
 void write_oam_data(unsigned char value) {
-    oam_data[oam_address++] = value;
+    if(oam_data[oam_address] != value) {
+        oam_data[oam_address] = value;
+        sprite_bucket_dirty = true;
+        change_memory();
+    }
+    oam_address += 1;
 }
 
-// 0x2005 (Write)
-unsigned char scroll_x;
-unsigned char scroll_y;
+// 0x4014 (DMA) の256バイトをまとめて書き込む
+// write_oam_dataを256回呼んだ場合と同じく、oam_addressから書き込んで一周し、oam_addressは変わらない
+// 毎フレーム同じ内容を転送するゲームが多いので、内容が変わらない場合はスプライトの一覧を作り直さない
+void write_oam_dma(unsigned char *data) {
+    if(memcmp(oam_data + oam_address, data, 256 - oam_address) == 0 && memcmp(oam_data, data + 256 - oam_address, oam_address) == 0) {
+        return;
+    }
+    memcpy(oam_data + oam_address, data, 256 - oam_address);
+    memcpy(oam_data, data + 256 - oam_address, oam_address);
+    sprite_bucket_dirty = true;
+    change_memory();
+}
 
+// 0x2005 (Write)
+// 1回目はxスクロール(上位5ビットがcoarse X、下位3ビットがx)、2回目はyスクロール(上位5ビットがcoarse Y、下位3ビットが細かいyスクロール)
 void write_ppu_scroll(unsigned char value) {
     if(w == false) {
-        scroll_x = value;
+        t = (t & ~0x001f) | (value >> 3);
+        fine_x = value & 0x07;
     } else {
-        scroll_y = value;
+        t = (t & ~0x73e0) | ((value & 0x07) << 12) | ((value >> 3) << 5);
     }
+    sign_register(5 + 8 * w, value);
     w = !w;
 }
 
 // 0x2006 (Write)
-unsigned short ppu_address;
-
+// 1回目は上位6ビット(tのビット14はクリアされる)、2回目は下位8ビットを書き込み、tをvにコピーする
 void write_ppu_address(unsigned char value) {
     if(w == false) {
-        ppu_address = (ppu_address & 0x00ff) + (value << 8);
+        t = (t & 0x00ff) | ((value & 0x3f) << 8);
     } else {
-        ppu_address = (ppu_address & 0xff00) + value;
+        t = (t & 0xff00) | value;
+        v = t;
     }
+    sign_register(6 + 8 * w, value);
     w = !w;
 }
 
@@ -210,36 +298,12 @@ void write_ppu_address(unsigned char value) {
 // 0x4000-0xffff 0x0000-0x3fffのミラー
 unsigned char buffer;
 
-unsigned short mirror_nametable_address(unsigned short address) {
-    unsigned short nametable_address = address & 0xfff;
-    int nametable_index = (address >> 10) & 0x03;
-    if(rom->mirroring == MIRROR_HORIZONTAL) {
-        switch(nametable_index) {
-            case 0:
-                return nametable_address;
-            case 1: case 2:
-                return nametable_address - 0x400;
-            case 3:
-                return nametable_address - 0x800;
-        }
-    } else if(rom->mirroring == MIRROR_VERTICAL) {
-        switch(nametable_index) {
-            case 0: case 1:
-                return nametable_address;
-            case 2: case 3:
-                return nametable_address - 0x800;
-        }
-    }
-}
-
 unsigned char read_ppu_data(void) {
     unsigned char value = buffer;
-    ppu_address &= 0x3fff;
-    if(between(0x0000, ppu_address, 0x1fff)) {
-        buffer = rom->character_rom[ppu_address];
-    } else if(between(0x2000, ppu_address, 0x3eff)) {
-        buffer = nametable[mirror_nametable_address(ppu_address)];
-    } else if(between(0x3f00, ppu_address, 0x3fff)) {
+    unsigned short ppu_address = v & 0x3fff;
+    if(ppu_address < 0x3f00) {
+        buffer = *ppu_pointer(ppu_address);
+    } else {
         unsigned int address = ppu_address & 0x1f;
         if(address == 0x10 || address == 0x14 || address == 0x18 || address == 0x1c) {
             address -= 0x10;
@@ -248,169 +312,453 @@ unsigned char read_ppu_data(void) {
         if(ppu_mask.gray_scale) {
             value = buffer = buffer & 0x30;
         }
-    } else {
-        error("Invalid ppu read 0x%04X\n", ppu_address);
     }
-    ppu_address += ppu_control.increment_address ? 32 : 1;
+    v += ppu_control.increment_address ? 32 : 1;
+    sign_register(7, 0);
     return value;
 }
 
 void write_ppu_data(unsigned char value) {
-    ppu_address &= 0x3fff;
-    if(between(0x0000, ppu_address, 0x1fff)) {
-        if(rom->has_character_ram) {
-            rom->character_rom[ppu_address] = value;
+    unsigned short ppu_address = v & 0x3fff;
+    if(ppu_address < 0x3f00) {
+        unsigned char *page = ppu_write_page[ppu_address >> PAGE_SHIFT];
+        if(page != NULL && page[ppu_address & (PAGE_SIZE - 1)] != value) {
+            page[ppu_address & (PAGE_SIZE - 1)] = value;
+            if(ppu_address < 0x2000) {
+                invalidate_tile(page + (ppu_address & (PAGE_SIZE - 1)));
+            }
+            change_memory();
         }
-    } else if(between(0x2000, ppu_address, 0x3eff)) {
-        nametable[mirror_nametable_address(ppu_address)] = value;
-    } else if(between(0x3f00, ppu_address, 0x3fff)) {
+    } else {
         unsigned int address = ppu_address & 0x1f;
         if(address == 0x10 || address == 0x14 || address == 0x18 || address == 0x1c) {
             address -= 0x10;
         }
-        palette_table[address] = value;
+        if(palette_table[address] != value) {
+            palette_table[address] = value;
+            change_memory();
+        }
+    }
+    v += ppu_control.increment_address ? 32 : 1;
+    sign_register(7, 0);
+}
+
+// 描画が有効か (MMC3のスキャンラインカウンタはこの間だけ進む)
+bool is_rendering_enabled(void) {
+    return ppu_mask.render_background || ppu_mask.render_sprite;
+}
+
+// 次に描画するスキャンラインか261行目のドット260に達するまでのPPUサイクル数 (MMC3のスキャンラインカウンタ)
+unsigned int ppu_cycles_to_scanline_clock(void) {
+    unsigned int line = scanline;
+    unsigned int cycle;
+    if(ppu_cycle < 260) {
+        cycle = 260 - ppu_cycle;
     } else {
-        error("Invalid ppu write 0x%04X\n", ppu_address);
+        line = (line + 1) % 262;
+        cycle = 341 + 260 - ppu_cycle;
+    }
+    if(between(240, line, 260)) {
+        cycle += 341 * (261 - line);
     }
-    ppu_address += ppu_control.increment_address ? 32 : 1;
+    return cycle;
 }
 
-bool is_sprite0_hit(void) {
-    return oam_data[0] == scanline && oam_data[3] <= ppu_cycle && ppu_mask.render_background && ppu_mask.render_sprite;
+// 描画開始時の署名 (描画に関わるレジスタ、ページテーブル、メモリの内容の通し番号)
+void start_frame_signature(void) {
+    signature = 0xcbf29ce484222325ULL;
+    mix_signature(memory_serial);
+    mix_signature(v | (t << 16) | ((unsigned long long)fine_x << 32));
+    mix_signature(ppu_control.increment_address | (ppu_control.sprite_pattern_table_address << 1) | (ppu_control.background_pattern_table_address << 2) | (ppu_control.sprite_size << 3));
+    mix_signature(ppu_mask.render_leftmost_background | (ppu_mask.render_leftmost_sprite << 1) | (ppu_mask.render_background << 2) | (ppu_mask.render_sprite << 3));
+    for(int i = 0; i < PPU_PAGE_COUNT; i++) {
+        mix_signature((unsigned long long)ppu_read_page[i]);
+    }
 }
 
 void init_ppu(void) {
+    v = t = fine_x = 0;
     w = false;
     write_ppu_control(0);
     write_ppu_mask(0);
     oam_address = 0;
-    scroll_x = scroll_y = 0;
-    ppu_address = 0;
     buffer = 0;
-    set_nametable();
+    init_tile_cache();
+    map_chr(0x0000, rom->character_rom, 0x2000);
+    set_mirroring(rom->mirroring);
+    // 前のROMの画面が残らないように、最初のフレームはすべての行を描画する
+    change_memory();
+    start_frame_signature();
+}
+
+// vの細かいyスクロールを1行進める
+// coarse Yは29の次に隣の垂直方向のネームテーブルに移り、属性テーブルの範囲(30、31)から0に戻る場合は移らない
+void increment_y(void) {
+    if((v & 0x7000) != 0x7000) {
+        v += 0x1000;
+        return;
+    }
+    v &= ~0x7000;
+    unsigned int coarse_y = (v >> 5) & 0x1f;
+    if(coarse_y == 29) {
+        coarse_y = 0;
+        v ^= 0x0800;
+    } else if(coarse_y == 31) {
+        coarse_y = 0;
+    } else {
+        coarse_y += 1;
+    }
+    v = (v & ~0x03e0) | (coarse_y << 5);
 }
 
-unsigned char *create_palette(int palette_index) {
-    static unsigned char palette[4];
-    palette[0] = palette_table[0];
-    for(int i = 1; i <= 3; i++) {
-        palette[i] = palette_table[4 * palette_index + i];
+// 現在のスキャンラインの背景をvから描画する
+// 細かいxスクロールがある場合は33タイル目の左側まで見えるので、各タイルを1回ずつ読む
+// タイルごとに(パレット番号 * 4 + 色番号)を並べ、compose_lineで背景の16色に変換する
+// 不透明なピクセルはタイルの境界に合わせたビット列に並べてから、細かいxスクロール分ずらしてbackground_opaqueにする
+void render_background_line(void) {
+    unsigned short pattern_table = PATTERN_TABLE_BYTE_SIZE * ppu_control.background_pattern_table_address;
+    unsigned int fine_y = (v >> 12) & 0x07;
+    unsigned short address = v;
+    unsigned char index[TILE_PIXEL_SIZE * (TILE_NUMBER_X + 1)];
+    unsigned long long opaque[SCREEN_BLOCK_WIDTH / 64 + 1] = {0};
+    int tile_count = fine_x == 0 ? TILE_NUMBER_X : TILE_NUMBER_X + 1;
+    for(int tx = 0; tx < tile_count; tx++) {
+        unsigned char tile_index = *ppu_pointer(0x2000 | (address & 0x0fff));
+        unsigned char attribute = *ppu_pointer(0x23c0 | (address & 0x0c00) | ((address >> 4) & 0x38) | ((address >> 2) & 0x07));
+        // coarse Xとcoarse Yのビット1で、属性の2ビットのどれを使うかが決まる
+        unsigned int palette_index = (attribute >> (((address >> 4) & 0x04) | (address & 0x02))) & 0x03;
+        Decoded_Tile *tile = decode_tile(ppu_pointer(pattern_table + PATTERN_BYTE_SIZE * tile_index), false);
+        unsigned long long row;
+        memcpy(&row, tile->pixel + TILE_PIXEL_SIZE * fine_y, 8);
+        row |= 0x0101010101010101ULL * (palette_index << 2);
+        memcpy(index + TILE_PIXEL_SIZE * tx, &row, 8);
+        opaque[tx / 8] |= (unsigned long long)tile->opaque[fine_y] << (TILE_PIXEL_SIZE * (tx % 8));
+        // coarse Xを1タイル進める (32で隣の水平方向のネームテーブルに移る)
+        if((address & 0x001f) == 31) {
+            address = (address & ~0x001f) ^ 0x0400;
+        } else {
+            address += 1;
+        }
+    }
+    for(int i = 0; i < SCREEN_BLOCK_WIDTH / 64; i++) {
+        background_opaque[i] = fine_x == 0 ? opaque[i] : (opaque[i] >> fine_x) | (opaque[i + 1] << (64 - fine_x));
+    }
+    // 左端8ピクセルを隠す場合は背景色にする
+    if(ppu_mask.render_leftmost_background == false) {
+        memset(index + fine_x, 0, TILE_PIXEL_SIZE);
+        background_opaque[0] &= ~0xffULL;
+    }
+    // 各パレットの色0は共通の背景色
+    unsigned char palette[16];
+    for(int i = 0; i < 16; i++) {
+        palette[i] = palette_table[(i & 0x03) ? i : 0];
     }
-    return palette;
+    compose_line(screen + SCREEN_BLOCK_WIDTH * scanline, index + fine_x, palette);
 }
 
-void render_pixel(int px, int py, unsigned char *c) {
-    unsigned int *p = (unsigned int*)frame + BLOCK_PIXEL_SIZE * (px + SCREEN_PIXEL_WIDTH * py);
-    unsigned int rgb = *(unsigned int*)c;
-    for(int i = 0; i < BLOCK_PIXEL_SIZE; i++, p += SCREEN_PIXEL_WIDTH) {
-        for(int j = 0; j < BLOCK_PIXEL_SIZE; j++) {
-            p[j] = rgb;
+// 背景を表示しないスキャンラインは背景色で埋める (スプライトはすべて背景の手前になる)
+void clear_background_line(void) {
+    memset(screen + SCREEN_BLOCK_WIDTH * scanline, palette_table[0], SCREEN_BLOCK_WIDTH);
+    memset(background_opaque, 0, sizeof(background_opaque));
+}
+
+// スプライトの評価
+// OAMが変わった後の最初の評価で、64個のスプライトをY座標で各スキャンラインの一覧(OAMの順)に振り分けておく
+// 各スキャンラインの終わりに次のスキャンラインの一覧から先頭の8個をセカンダリOAMにコピーし、9個目以降がある場合はsprite_overflowをセットする
+// (実機のオーバーフロー判定の不具合は再現しない)
+// スプライトはOAMのY座標 + 1のスキャンラインから表示される
+unsigned char line_sprite[SCREEN_BLOCK_HEIGHT][64];
+unsigned char line_sprite_count[SCREEN_BLOCK_HEIGHT];
+// 各スキャンライン以降で最初にスプライトオーバーフローがセットされるスキャンライン (ない場合は-1、bucket_spritesで求める)
+short sprite_overflow_line[SCREEN_BLOCK_HEIGHT];
+unsigned char secondary_oam[4 * 8];
+int secondary_oam_count;
+// セカンダリOAMの先頭がスプライト0 (スプライトゼロヒットの判定対象)
+bool sprite0_in_line;
+
+int sprite_height(void) {
+    return ppu_control.sprite_size ? 16 : 8;
+}
+
+void bucket_sprites(void) {
+    memset(line_sprite_count, 0, sizeof(line_sprite_count));
+    for(int i = 0; i < 64; i++) {
+        unsigned int top = oam_data[4 * i] + 1;
+        for(unsigned int y = top; y < top + sprite_height() && y < SCREEN_BLOCK_HEIGHT; y++) {
+            line_sprite[y][line_sprite_count[y]++] = i;
         }
     }
+    int overflow_line = -1;
+    for(int line = SCREEN_BLOCK_HEIGHT - 1; line >= 0; line--) {
+        if(line + 1 < SCREEN_BLOCK_HEIGHT && line_sprite_count[line + 1] > 8) {
+            overflow_line = line;
+        }
+        sprite_overflow_line[line] = overflow_line;
+    }
+    sprite_bucket_dirty = false;
+}
+
+// lineに表示するスプライトを評価する
+void evaluate_sprites(unsigned int line) {
+    if(sprite_bucket_dirty) {
+        bucket_sprites();
+    }
+    secondary_oam_count = 0;
+    sprite0_in_line = false;
+    if(line >= SCREEN_BLOCK_HEIGHT) {
+        return;
+    }
+    secondary_oam_count = line_sprite_count[line];
+    sprite0_in_line = secondary_oam_count > 0 && line_sprite[line][0] == 0;
+    if(secondary_oam_count > 8) {
+        secondary_oam_count = 8;
+        ppu_status.sprite_overflow = true;
+    }
+    for(int i = 0; i < secondary_oam_count; i++) {
+        memcpy(secondary_oam + 4 * i, oam_data + 4 * line_sprite[line][i], 4);
+    }
+}
+
+// スプライトオーバーフローがセットされるスキャンライン (次のスキャンラインに9個以上のスプライトがある、最初のline以降の行)
+// ない場合は-1
+int next_sprite_overflow_line(unsigned int line) {
+    if(sprite_bucket_dirty) {
+        bucket_sprites();
+    }
+    return line < SCREEN_BLOCK_HEIGHT ? sprite_overflow_line[line] : -1;
+}
+
+// maskのxからの8ビット (64ビットの境界をまたぐ場合は次の要素から補う)
+unsigned int mask_window(unsigned long long *mask, unsigned int x) {
+    unsigned int shift = x % 64;
+    unsigned long long bits = mask[x / 64] >> shift;
+    if(shift > 56) {
+        bits |= mask[x / 64 + 1] << (64 - shift);
+    }
+    return bits & 0xff;
+}
+
+// OAMのスプライト0を描画する、line以降の最初のスキャンライン
+// ない場合は-1
+int sprite0_line_from(unsigned int line) {
+    unsigned int top = oam_data[0] + 1;
+    unsigned int bottom = top + sprite_height() - 1;
+    if(line < top) {
+        line = top;
+    }
+    return line <= bottom && line < SCREEN_BLOCK_HEIGHT ? (int)line : -1;
 }
 
-void render_nametable(int base_px, int base_py, unsigned char *_nametable) {
-    unsigned char *pattern_table = rom->character_rom + PATTERN_TABLE_BYTE_SIZE * ppu_control.background_pattern_table_address;
-    int sx = ppu_mask.render_leftmost_background ? 0 : 8;
-    int stx, sty;
-    for(stx = 0; base_px + TILE_PIXEL_SIZE * (stx + 1) - 1 < 0; stx++);
-    for(sty = 0; base_py + TILE_PIXEL_SIZE * (sty + 1) - 1 < 0; sty++);
-    int ty = scanline / TILE_PIXEL_SIZE;
-    if(between(sty, ty, TILE_NUMBER_Y - 1) && base_py + TILE_PIXEL_SIZE * ty < SCREEN_BLOCK_HEIGHT) {
-        int spy = 0;
-        if(base_py < 0 && ty == sty) {
-            spy = (-base_py) % TILE_PIXEL_SIZE;
+// スプライトゼロヒットが起こりうる最初のスキャンライン (line以降でスプライト0を描画する行)
+// ない場合は-1
+int next_sprite0_line(unsigned int line) {
+    if(sprite0_in_line) {
+        return line;
+    }
+    return sprite0_line_from(line);
+}
+
+// セカンダリOAMのスプライトを現在のスキャンラインに描画する
+// 番号の小さいスプライトから順に、まだ手前のスプライトが不透明でないピクセルを取っていく
+// - 背景の後ろのスプライトも不透明なピクセルを取るので、それより後ろのスプライトは背景の上でも隠れる
+// - 背景の後ろのスプライトは、背景が不透明なピクセルには書き込まない
+// - スプライト0の不透明なピクセルが背景の不透明なピクセルと重なるとスプライトゼロヒット (x = 255は除く)
+void render_sprite_line(void) {
+    unsigned char *line = screen + SCREEN_BLOCK_WIDTH * scanline;
+    unsigned long long claimed[SCREEN_BLOCK_WIDTH / 64 + 1] = {0};
+    for(int i = 0; i < secondary_oam_count; i++) {
+        unsigned char base_py = secondary_oam[4 * i + 0];
+        unsigned char tile_index = secondary_oam[4 * i + 1];
+        unsigned char attribute = secondary_oam[4 * i + 2];
+        unsigned char base_px = secondary_oam[4 * i + 3];
+
+        unsigned char *palette = palette_table + 0x10 + 4 * (attribute & 0x03);
+        bool behind_background = (attribute & 0x20) != 0;
+        bool flip_horizontal = (attribute & 0x40) != 0;
+        bool flip_vertical = (attribute & 0x80) != 0;
+
+        int row = scanline - (base_py + 1);
+        if(flip_vertical) {
+            row = sprite_height() - 1 - row;
+        }
+        // 8*16モードでは、タイル番号のビット0がパターンテーブルで、上半分が偶数、下半分が奇数のタイル
+        unsigned short pattern;
+        if(ppu_control.sprite_size) {
+            pattern = PATTERN_TABLE_BYTE_SIZE * (tile_index & 0x01) + PATTERN_BYTE_SIZE * ((tile_index & 0xfe) + row / TILE_PIXEL_SIZE);
+        } else {
+            pattern = PATTERN_TABLE_BYTE_SIZE * ppu_control.sprite_pattern_table_address + PATTERN_BYTE_SIZE * tile_index;
+        }
+        Decoded_Tile *tile = decode_tile(ppu_pointer(pattern), flip_horizontal);
+
+        // 右端で切れる部分と、左端8ピクセルを隠す場合はその範囲にかかる部分は透明として扱う
+        int count = base_px + TILE_PIXEL_SIZE <= SCREEN_BLOCK_WIDTH ? TILE_PIXEL_SIZE : SCREEN_BLOCK_WIDTH - base_px;
+        unsigned int opaque = tile->opaque[row % TILE_PIXEL_SIZE] & ((1 << count) - 1);
+        if(ppu_mask.render_leftmost_sprite == false && base_px < 8) {
+            opaque &= ~(0xff >> base_px);
+        }
+        unsigned int background = mask_window(background_opaque, base_px);
+        if(i == 0 && sprite0_in_line && ppu_mask.render_background) {
+            unsigned int hit = opaque & background;
+            if(base_px + TILE_PIXEL_SIZE > SCREEN_BLOCK_WIDTH - 1) {
+                hit &= ~(1 << (SCREEN_BLOCK_WIDTH - 1 - base_px));
+            }
+            if(hit) {
+                ppu_status.sprite0_hit = true;
+            }
+        }
+
+        unsigned int visible = opaque & ~mask_window(claimed, base_px);
+        claimed[base_px / 64] |= (unsigned long long)visible << (base_px % 64);
+        if(base_px % 64 > 56) {
+            claimed[base_px / 64 + 1] |= visible >> (64 - base_px % 64);
         }
-        for(int tx = stx; tx < TILE_NUMBER_X && base_px + TILE_PIXEL_SIZE * tx < SCREEN_BLOCK_WIDTH; tx++) {
-            unsigned char *pattern = pattern_table + PATTERN_BYTE_SIZE * _nametable[tx + TILE_NUMBER_X * ty];
-            unsigned char attribute = _nametable[0x3c0 + (tx / 4) + 8 * (ty / 4)];
-            unsigned char *palette = create_palette((attribute >> (2 * ((tx / 2) % 2) + 4 * ((ty / 2) % 2))) & 0x03);
-            int spx = 0;
-            if(base_px < 0 && tx == stx) {
-                spx = (-base_px) % TILE_PIXEL_SIZE;
+        if(behind_background) {
+            visible &= ~background;
+        }
+        if(visible) {
+            compose_sprite_row(line + base_px, tile->pixel + TILE_PIXEL_SIZE * (row % TILE_PIXEL_SIZE), palette, visible, count);
+        }
+    }
+}
+
+// 可視スキャンラインのピクセルをドット256で描画し、vを次の行に進めて水平方向をtから戻す
+// MMC3のIRQ(ドット260)の処理で書き込んだスクロール、PPUCTRL、CHRのバンクは、実機と同じく次の行から反映される
+void render_line(void) {
+    if(scanline >= SCREEN_BLOCK_HEIGHT) {
+        return;
+    }
+    bool unchanged = line_signature[scanline] == signature;
+    line_signature[scanline] = signature;
+    changed_line_count += unchanged == false;
+    if(is_rendering_enabled()) {
+        // 前のフレームと同じ行はscreenに残っているので、スプライトゼロヒットだけを前のフレームと同じ行でセットする
+        if(unchanged) {
+            if(scanline == previous_sprite0_hit_line) {
+                ppu_status.sprite0_hit = true;
+            }
+        } else {
+            if(ppu_mask.render_background) {
+                render_background_line();
+            } else {
+                clear_background_line();
             }
-            for(int py = spy, y = base_py + TILE_PIXEL_SIZE * ty + spy; py < TILE_PIXEL_SIZE && between(0, y, SCREEN_BLOCK_HEIGHT - 1); py++, y++) {
-                unsigned char pattern_low = pattern[py];
-                unsigned char pattern_high = pattern[py + 8];
-                for(int px = spx, x = base_px + TILE_PIXEL_SIZE * tx + spx; px < TILE_PIXEL_SIZE && between(sx, x, SCREEN_BLOCK_WIDTH - 1); px++, x++) {
-                    int color_index = ((pattern_low >> (7 - px)) & 1) + ((pattern_high >> (7 - px)) & 1) * 2;
-                    render_pixel(x, y, color + 3 * palette[color_index]);
-                }
+            if(ppu_mask.render_sprite) {
+                render_sprite_line();
             }
         }
+        if(ppu_status.sprite0_hit && sprite0_hit_line < 0) {
+            sprite0_hit_line = scanline;
+        }
+        increment_y();
+        v = (v & ~0x041f) | (t & 0x041f);
+    } else if(unchanged == false) {
+        // 描画が無効な可視スキャンラインも、前のフレームの内容を残さずに背景色で埋める
+        clear_background_line();
     }
 }
 
-void render_background(void) {
-    if(ppu_mask.render_background) {
-        render_nametable(-scroll_x, -scroll_y, nametable_top_left);
-        render_nametable(SCREEN_BLOCK_WIDTH - scroll_x, -scroll_y, nametable_top_right);
-        render_nametable(-scroll_x, SCREEN_BLOCK_HEIGHT - scroll_y, nametable_bottom_left);
-        render_nametable(SCREEN_BLOCK_WIDTH - scroll_x, SCREEN_BLOCK_HEIGHT - scroll_y, nametable_bottom_right);
-    }
-}
-
-void render_sprite(void) {
-    if(ppu_mask.render_sprite) {
-        unsigned char *pattern_table = rom->character_rom + PATTERN_TABLE_BYTE_SIZE * ppu_control.sprite_pattern_table_address;
-        for(int i = 63; i >= 0; i--) {
-            unsigned char base_py = oam_data[4 * i + 0];
-            unsigned char tile_index = oam_data[4 * i + 1];
-            unsigned char attribute = oam_data[4 * i + 2];
-            unsigned char base_px = oam_data[4 * i + 3];
-
-            unsigned char *palette = palette_table + 0x10 + 4 * (attribute & 0x03);
-            bool behind_background = (attribute & 0x20) != 0;
-            bool flip_horizontal = (attribute & 0x40) != 0;
-            bool flip_vertical = (attribute & 0x80) != 0;
-
-            // if(behind_background) {
-            //     continue;
-            // }
-
-            int max_px = (base_px + TILE_PIXEL_SIZE - 1) < SCREEN_BLOCK_WIDTH ? TILE_PIXEL_SIZE : SCREEN_BLOCK_WIDTH - base_px;
-            int max_py = (base_py + TILE_PIXEL_SIZE - 1) < SCREEN_BLOCK_HEIGHT ? TILE_PIXEL_SIZE : SCREEN_BLOCK_HEIGHT - base_py;
-
-            unsigned char *pattern = pattern_table + PATTERN_BYTE_SIZE * tile_index;
-            for(int py = 0; py < max_py; py++) {
-                int pattern_index = flip_vertical == false ? py : 7 - py;
-                unsigned char pattern_low = pattern[pattern_index];
-                unsigned char pattern_high = pattern[pattern_index + 8];
-                for(int px = 0; px < max_px; px++) {
-                    pattern_index = flip_horizontal == false ? px : 7 - px;
-                    int color_index = ((pattern_low >> (7 - pattern_index)) & 1) + ((pattern_high >> (7 - pattern_index)) & 1) * 2;
-                    if(color_index) {
-                        render_pixel(base_px + px, base_py + py, color + 3 * palette[color_index]);
-                    }
-                }
+// スキャンラインの終わりの処理
+void end_line(void) {
+    // 描画が有効な場合、スキャンラインの終わりに次のスキャンラインに描画するスプライトを評価し、
+    // 261行目の終わり(描画開始前)にはvをtで置き換える
+    if(scanline < 240 && is_rendering_enabled()) {
+        evaluate_sprites(scanline + 1);
+    } else if(scanline == 261 && is_rendering_enabled()) {
+        evaluate_sprites(0);
+        v = t;
+    } else {
+        secondary_oam_count = 0;
+        sprite0_in_line = false;
+    }
+    if(scanline == 261) {
+        start_frame_signature();
+        previous_sprite0_hit_line = sprite0_hit_line;
+        sprite0_hit_line = -1;
+        changed_line_count = 0;
+    }
+    ppu_cycle = 0;
+    scanline += 1;
+    if(scanline == 241) {
+        frame_ready = true;
+        interrupt_run();
+        finish_tile_frame();
+        // すべての行が前のフレームと同じなら、表示中のフレームをそのまま使う
+        if(changed_line_count == 0) {
+            skipped_frame_count += 1;
+        } else {
+            frame_count += 1;
+            gtk_widget_queue_draw(drawing_area);
+#ifdef SKIPPED_FRAME_STATS
+            static unsigned int reported_skipped_frame_count;
+            if(reported_skipped_frame_count != skipped_frame_count) {
+                fprintf(stderr, "%u frames skipped\n", skipped_frame_count);
+                reported_skipped_frame_count = skipped_frame_count;
             }
+#endif
         }
+        ppu_status.in_vblank = true;
+        if(ppu_control.generate_nmi) {
+            raise_nmi();
+        }
+    } else if(scanline == 262) {
+        scanline = 0;
+        ppu_status.sprite_overflow = false;
+        ppu_status.sprite0_hit = false;
+        ppu_status.in_vblank = false;
     }
 }
 
 void tick_ppu(unsigned int cycle) {
+    unsigned int previous_cycle = ppu_cycle;
     ppu_cycle += cycle;
-    if(ppu_cycle >= 341) {
-        if(is_sprite0_hit()) {
-            ppu_status.sprite0_hit = true;
+    // ほとんどの呼び出しはドット256、260、スキャンラインの終わりのどれもまたがない
+    if(ppu_cycle < 256 || (previous_cycle >= 260 && ppu_cycle < 341)) {
+        return;
+    }
+    // 1回で何スキャンラインでも進められるように、ドット256とスキャンラインの終わりで区切って処理する
+    ppu_cycle = previous_cycle;
+    while(cycle > 0) {
+        unsigned int boundary = ppu_cycle < 256 ? 256 : 341;
+        unsigned int step = boundary - ppu_cycle < cycle ? boundary - ppu_cycle : cycle;
+        previous_cycle = ppu_cycle;
+        ppu_cycle += step;
+        cycle -= step;
+        if(previous_cycle < 260 && ppu_cycle >= 260 && (scanline < 240 || scanline == 261) && is_rendering_enabled()) {
+            scanline_clock_count += 1;
         }
-        if((scanline & 0x07) == 0) {
-            render_background();
+        if(ppu_cycle == 256) {
+            render_line();
+        } else if(ppu_cycle == 341) {
+            end_line();
         }
-        ppu_cycle -= 341;
-        scanline += 1;
-        if(scanline == 241) {
-            render_sprite();
-            gtk_widget_queue_draw(drawing_area);
-            ppu_status.in_vblank = true;
-            if(ppu_control.generate_nmi) {
-                nmi();
-            }
-        } else if(scanline == 262) {
-            scanline = 0;
-            ppu_status.sprite_overflow = false;
-            ppu_status.sprite0_hit = false;
-            ppu_status.in_vblank = false;
+    }
+}
+
+// 現在のスキャンラインからlineの終わりまでに残っているスキャンライン数 (lineが過ぎている場合は次のフレームのline)
+unsigned int lines_until_end_of(unsigned int line) {
+    return line >= scanline ? line - scanline : line + 262 - scanline;
+}
+
+// CPUから見える状態が次に変化するまでのPPUサイクル数を返す
+// 変化するのはスプライトゼロヒット(描画するドット256)と、スキャンラインの終わりのスプライトオーバーフロー、241行目(VBLANK、NMI、フレーム終了)、262行目(フラグのクリア)のいずれか
+unsigned int ppu_cycles_to_next_event(void) {
+    unsigned int lines = lines_until_end_of(240);
+    if(lines_until_end_of(261) < lines) {
+        lines = lines_until_end_of(261);
+    }
+    unsigned int cycles = 341 - ppu_cycle + 341 * lines;
+    if(ppu_status.sprite0_hit == false && ppu_mask.render_background && ppu_mask.render_sprite && scanline < SCREEN_BLOCK_HEIGHT) {
+        // ドット256を過ぎた行は描画済み
+        int line = ppu_cycle < 256 ? next_sprite0_line(scanline) : sprite0_line_from(scanline + 1);
+        if(line >= 0 && 256 + 341 * (line - scanline) - ppu_cycle < cycles) {
+            cycles = 256 + 341 * (line - scanline) - ppu_cycle;
+        }
+    }
+    if(ppu_status.sprite_overflow == false && is_rendering_enabled() && scanline < SCREEN_BLOCK_HEIGHT) {
+        int line = next_sprite_overflow_line(scanline);
+        if(line >= 0 && 341 - ppu_cycle + 341 * lines_until_end_of(line) < cycles) {
+            cycles = 341 - ppu_cycle + 341 * lines_until_end_of(line);
         }
     }
+    return cycles;
 }
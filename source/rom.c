@@ -1,54 +1,182 @@
 #include "common.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <zlib.h>
+
+// ヘッダを修正するデータベース (load_header_database)
+#define ROM_DATABASE "./rom/database.txt"
 
 extern ROM *rom;
+extern unsigned long long cpu_cycle;
+extern unsigned int scanline_clock_count;
 
 void (*init_bank)(void);
-unsigned char (*read_bank1)(unsigned short address);
-unsigned char (*read_bank2)(unsigned short address);
 void (*write_bank)(unsigned short address, unsigned char value);
 
-unsigned char *low_bank;
-unsigned char *high_bank;
+void map_prg(unsigned short address, unsigned char *bank, unsigned int size);
+void map_chr(unsigned short address, unsigned char *bank, unsigned int size);
+void set_mirroring(unsigned int mirroring);
+void sync_ppu(void);
+unsigned int ppu_cycles_to_scanline_clock(void);
+void schedule_event(Event_Type type, unsigned long long cycle, void (*handler)(void));
+void set_irq(unsigned char source, bool active);
+void init_event(void);
+void init_memory_map(void);
+void init_ppu(void);
+unsigned char read8(unsigned short address);
 
-// マッパー0
+// マッパーはバンクの切り替え時にページテーブルのポインタを書き換えるだけで、読み込みには関与しない
+// バンク番号はバンク数で割った余りを使う (負の値は最後から数える)
+// PRGは8KB、CHRは1KB単位の窓まで扱える
 
-void mapper0_init_bank(void) {
-    low_bank = high_bank = rom->program_rom;
-    if(rom->program_rom_size != 0x4000) {
-        high_bank = rom->program_rom + 0x4000;
+// addressからsizeバイトの窓に、PRG-ROMのsizeバイト単位のbank番目を割り当てる
+void set_prg_bank(unsigned short address, int bank, unsigned int size) {
+    int count = rom->program_rom_size / size;
+    if(count == 0) {
+        // 窓よりROMが小さい場合は繰り返し割り当てる (parse_headerが1KB未満の端数を弾くので、PAGE_SIZEより小さくはならない)
+        if(size <= PAGE_SIZE) {
+            return;
+        }
+        set_prg_bank(address, 0, size / 2);
+        set_prg_bank(address + size / 2, 0, size / 2);
+        return;
+    }
+    bank %= count;
+    if(bank < 0) {
+        bank += count;
     }
+    map_prg(address, rom->program_rom + size * bank, size);
 }
 
-unsigned char mapper0_read_low_bank(unsigned short address) {
-    return low_bank[address - 0x8000];
+// addressからsizeバイトの窓に、CHR-ROM(CHR-RAM)のsizeバイト単位のbank番目を割り当てる
+void set_chr_bank(unsigned short address, int bank, unsigned int size) {
+    int count = rom->character_rom_size / size;
+    if(count == 0) {
+        // 窓よりROMが小さい場合は繰り返し割り当てる (parse_headerが1KB未満の端数を弾くので、PAGE_SIZEより小さくはならない)
+        if(size <= PAGE_SIZE) {
+            return;
+        }
+        set_chr_bank(address, 0, size / 2);
+        set_chr_bank(address + size / 2, 0, size / 2);
+        return;
+    }
+    bank %= count;
+    if(bank < 0) {
+        bank += count;
+    }
+    map_chr(address, rom->character_rom + size * bank, size);
 }
 
-unsigned char mapper0_read_high_bank(unsigned short address) {
-    return high_bank[address - 0xc000];
+// マッパー0 (NROM)
+// 16KBのPRG-ROMは0xc000-0xffffにも同じものが見える
+
+void mapper0_init_bank(void) {
+    set_prg_bank(0x8000, 0, 0x4000);
+    set_prg_bank(0xc000, 1, 0x4000);
+    set_chr_bank(0x0000, 0, 0x2000);
 }
 
 void mapper0_write_bank(unsigned short address, unsigned char value) {
 
 }
 
-// マッパー2
-// 0x8000-0xbfff 16KBの切り替え可能なPRG-ROMバンク
-// 0xc000-0xffff 16KBの最後のPRG-ROMバンク
-// 書き込みの下位3ビットでバンク選択を行う
+// マッパー1 (MMC1)
+// 0x8000-0xffffへの5回の書き込みで、ビット0を下位から順にシフトレジスタに入れ、5回目のアドレスでレジスタを選ぶ
+// ビット7が1の書き込みでシフトレジスタをリセットし、PRGモードを3にする
+// 連続するサイクルの書き込み (INCなどの読み込み-変更-書き込み命令の2回目) は無視する
+// 0x8000-0x9fff コントロール (ビット0-1 ミラーリング、ビット2-3 PRGモード、ビット4 CHRモード)
+// 0xa000-0xbfff CHRバンク0
+// 0xc000-0xdfff CHRバンク1 (4KBモードのみ)
+// 0xe000-0xffff PRGバンク
 
-void mapper2_init_bank(void) {
-    low_bank = rom->program_rom;
-    high_bank = rom->program_rom + 0x4000 * 7;
+unsigned char mmc1_shift, mmc1_shift_count;
+unsigned char mmc1_control, mmc1_chr_bank0, mmc1_chr_bank1, mmc1_prg_bank;
+unsigned long long mmc1_write_cycle;
+
+void mmc1_update_bank(void) {
+    static unsigned int mirroring[] = {MIRROR_SINGLE_LOW, MIRROR_SINGLE_HIGH, MIRROR_VERTICAL, MIRROR_HORIZONTAL};
+    if(rom->mirroring != MIRROR_FOUR_SCREEN) {
+        set_mirroring(mirroring[mmc1_control & 0x03]);
+    }
+    switch((mmc1_control >> 2) & 0x03) {
+        case 0: case 1:
+            set_prg_bank(0x8000, (mmc1_prg_bank & 0x0f) >> 1, 0x8000);
+            break;
+        case 2:
+            set_prg_bank(0x8000, 0, 0x4000);
+            set_prg_bank(0xc000, mmc1_prg_bank & 0x0f, 0x4000);
+            break;
+        case 3:
+            set_prg_bank(0x8000, mmc1_prg_bank & 0x0f, 0x4000);
+            set_prg_bank(0xc000, -1, 0x4000);
+            break;
+    }
+    if(mmc1_control & 0x10) {
+        set_chr_bank(0x0000, mmc1_chr_bank0, 0x1000);
+        set_chr_bank(0x1000, mmc1_chr_bank1, 0x1000);
+    } else {
+        set_chr_bank(0x0000, mmc1_chr_bank0 >> 1, 0x2000);
+    }
 }
 
-unsigned char mapper2_read_low_bank(unsigned short address) {
-    return low_bank[address - 0x8000];
+void mapper1_init_bank(void) {
+    mmc1_shift = mmc1_shift_count = 0;
+    mmc1_control = 0x0c;
+    mmc1_chr_bank0 = mmc1_chr_bank1 = mmc1_prg_bank = 0;
+    mmc1_write_cycle = cpu_cycle - 2;
+    mmc1_update_bank();
 }
 
-unsigned char mapper2_read_high_bank(unsigned short address) {
-    return high_bank[address - 0xc000];
+void mapper1_write_bank(unsigned short address, unsigned char value) {
+    bool consecutive = cpu_cycle - mmc1_write_cycle <= 1;
+    mmc1_write_cycle = cpu_cycle;
+    if(consecutive) {
+        return;
+    }
+    if(value & 0x80) {
+        mmc1_shift = mmc1_shift_count = 0;
+        mmc1_control |= 0x0c;
+        mmc1_update_bank();
+        return;
+    }
+    mmc1_shift |= (value & 0x01) << mmc1_shift_count;
+    if(++mmc1_shift_count < 5) {
+        return;
+    }
+    switch((address >> 13) & 0x03) {
+        case 0:
+            mmc1_control = mmc1_shift;
+            break;
+        case 1:
+            mmc1_chr_bank0 = mmc1_shift;
+            break;
+        case 2:
+            mmc1_chr_bank1 = mmc1_shift;
+            break;
+        case 3:
+            mmc1_prg_bank = mmc1_shift;
+            break;
+    }
+    mmc1_shift = mmc1_shift_count = 0;
+    mmc1_update_bank();
+}
+
+// マッパー2 (UxROM)
+// 0x8000-0xbfff 16KBの切り替え可能なPRG-ROMバンク
+// 0xc000-0xffff 16KBの最後のPRG-ROMバンク
+// 書き込みの下位4ビットでバンク選択を行う
+
+void mapper2_init_bank(void) {
+    set_prg_bank(0x8000, 0, 0x4000);
+    set_prg_bank(0xc000, -1, 0x4000);
+    set_chr_bank(0x0000, 0, 0x2000);
 }
 
 void mapper2_write_bank(unsigned short address, unsigned char value) {
@@ -57,53 +185,516 @@ void mapper2_write_bank(unsigned short address, unsigned char value) {
     if(bank_max <= value) {
         value = bank_max - 1;
     }
-    low_bank = rom->program_rom + 0x4000 * value;
+    set_prg_bank(0x8000, value, 0x4000);
 }
 
-ROM *load_rom(char *file_name) {
-    FILE *fp = fopen(file_name, "rb");
-    if(fp == NULL) {
-        error("Cannot open %s\n", file_name);
+// マッパー3 (CNROM)
+// PRG-ROMはマッパー0と同じで、書き込みで8KBのCHR-ROMバンクを選択する
+
+void mapper3_write_bank(unsigned short address, unsigned char value) {
+    set_chr_bank(0x0000, value, 0x2000);
+}
+
+// マッパー4 (MMC3)
+// 0x8000 (偶数) バンク選択 (ビット0-2 書き込み先のR0-R7、ビット6 PRGモード、ビット7 CHRのA12反転)
+// 0x8001 (奇数) バンクデータ
+// 0xa000 (偶数) ミラーリング (0 => 垂直, 1 => 水平)
+// 0xa001 (奇数) PRG-RAMの保護 (未実装)
+// 0xc000 (偶数) IRQラッチ
+// 0xc001 (奇数) IRQカウンタのリロード
+// 0xe000 (偶数) IRQ無効化と確認応答
+// 0xe001 (奇数) IRQ有効化
+// スキャンラインカウンタは、描画が有効な間、描画するスキャンラインと261行目のドット260ごとに進める (EVENT_MAPPER)
+
+unsigned char mmc3_bank_select;
+unsigned char mmc3_register[8];
+unsigned char mmc3_irq_latch, mmc3_irq_counter;
+bool mmc3_irq_reload, mmc3_irq_enable;
+// 処理したPPUのスキャンラインカウンタのクロック数 (ppu.cのscanline_clock_countに追いつくまで進める)
+unsigned int mmc3_clock_count;
+
+void mmc3_update_bank(void) {
+    bool prg_mode = (mmc3_bank_select & 0x40) != 0;
+    set_prg_bank(prg_mode ? 0xc000 : 0x8000, mmc3_register[6], 0x2000);
+    set_prg_bank(0xa000, mmc3_register[7], 0x2000);
+    set_prg_bank(prg_mode ? 0x8000 : 0xc000, -2, 0x2000);
+    set_prg_bank(0xe000, -1, 0x2000);
+    // A12反転時は2KBの窓が0x1000側、1KBの窓が0x0000側になる
+    unsigned short inversion = (mmc3_bank_select & 0x80) ? 0x1000 : 0x0000;
+    set_chr_bank(0x0000 ^ inversion, mmc3_register[0] >> 1, 0x0800);
+    set_chr_bank(0x0800 ^ inversion, mmc3_register[1] >> 1, 0x0800);
+    for(int i = 0; i < 4; i++) {
+        set_chr_bank((0x1000 + 0x0400 * i) ^ inversion, mmc3_register[2 + i], 0x0400);
     }
+}
 
-    fseek(fp, 0, SEEK_END);
-    int file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+// 描画が有効かどうかはPPUがドット260を過ぎた時点で判定する
+// OAM DMAのように1回のtick()で複数のスキャンラインが進んだ場合は、その間のクロックをまとめて処理する
+void mmc3_clock_scanline(void) {
+    sync_ppu();
+    while(mmc3_clock_count != scanline_clock_count) {
+        mmc3_clock_count += 1;
+        if(mmc3_irq_counter == 0 || mmc3_irq_reload) {
+            mmc3_irq_counter = mmc3_irq_latch;
+            mmc3_irq_reload = false;
+        } else {
+            mmc3_irq_counter -= 1;
+        }
+        if(mmc3_irq_counter == 0 && mmc3_irq_enable) {
+            set_irq(IRQ_MAPPER, true);
+        }
+    }
+    schedule_event(EVENT_MAPPER, cpu_cycle + (ppu_cycles_to_scanline_clock() + 2) / 3, mmc3_clock_scanline);
+}
 
-    ROM *rom = malloc(sizeof(ROM));
-    rom->rom = malloc(file_size);
-    fread(rom->rom, 1, file_size, fp);
+void mapper4_init_bank(void) {
+    mmc3_bank_select = 0;
+    for(int i = 0; i < 8; i++) {
+        mmc3_register[i] = 0;
+    }
+    mmc3_irq_latch = mmc3_irq_counter = 0;
+    mmc3_irq_reload = mmc3_irq_enable = false;
+    mmc3_clock_count = scanline_clock_count;
+    mmc3_update_bank();
+    schedule_event(EVENT_MAPPER, cpu_cycle + (ppu_cycles_to_scanline_clock() + 2) / 3, mmc3_clock_scanline);
+}
+
+void mapper4_write_bank(unsigned short address, unsigned char value) {
+    switch((address & 0xe000) | (address & 0x01)) {
+        case 0x8000:
+            mmc3_bank_select = value;
+            mmc3_update_bank();
+            break;
+        case 0x8001:
+            mmc3_register[mmc3_bank_select & 0x07] = value;
+            mmc3_update_bank();
+            break;
+        case 0xa000:
+            if(rom->mirroring != MIRROR_FOUR_SCREEN) {
+                set_mirroring((value & 0x01) ? MIRROR_HORIZONTAL : MIRROR_VERTICAL);
+            }
+            break;
+        case 0xc000:
+            mmc3_irq_latch = value;
+            break;
+        case 0xc001:
+            mmc3_irq_counter = 0;
+            mmc3_irq_reload = true;
+            break;
+        case 0xe000:
+            mmc3_irq_enable = false;
+            set_irq(IRQ_MAPPER, false);
+            break;
+        case 0xe001:
+            mmc3_irq_enable = true;
+            break;
+    }
+}
+
+// マッパー7 (AxROM)
+// 書き込みのビット0-2で32KBのPRG-ROMバンク、ビット4で1画面ミラーリングのネームテーブルを選択する
+
+void mapper7_init_bank(void) {
+    set_prg_bank(0x8000, 0, 0x8000);
+    set_chr_bank(0x0000, 0, 0x2000);
+    set_mirroring(MIRROR_SINGLE_LOW);
+}
+
+void mapper7_write_bank(unsigned short address, unsigned char value) {
+    set_prg_bank(0x8000, value & 0x07, 0x8000);
+    set_mirroring((value & 0x10) ? MIRROR_SINGLE_HIGH : MIRROR_SINGLE_LOW);
+}
+
+typedef struct {
+    unsigned int number;
+    void (*init_bank)(void);
+    void (*write_bank)(unsigned short address, unsigned char value);
+} Mapper;
+
+Mapper mapper[] = {
+    {0, mapper0_init_bank, mapper0_write_bank},
+    {1, mapper1_init_bank, mapper1_write_bank},
+    {2, mapper2_init_bank, mapper2_write_bank},
+    {3, mapper0_init_bank, mapper3_write_bank},
+    {4, mapper4_init_bank, mapper4_write_bank},
+    {7, mapper7_init_bank, mapper7_write_bank}
+};
+
+// ROMファイル全体を読み込み専用でメモリに割り当てる (同じROMを開いた複数のプロセスでページを共有できる)
+// gzipで圧縮されている場合は、展開後の大きさの匿名マッピングに直接展開してから読み込み専用にする
+// 失敗した場合はNULLを返す (library.cのスレッドからも呼ばれるので、error()は使わない)
+unsigned char *map_rom_file(char *file_name, unsigned int *size) {
+    int fd = open(file_name, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    unsigned char magic[2];
+    if(fstat(fd, &st) != 0 || st.st_size < 16 || pread(fd, magic, 2, 0) != 2) {
+        close(fd);
+        return NULL;
+    }
+
+    if(magic[0] != 0x1f || magic[1] != 0x8b) {
+        *size = st.st_size;
+        unsigned char *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        return data == MAP_FAILED ? NULL : data;
+    }
+
+    // gzipの末尾の4バイトは展開後の大きさ
+    unsigned char trailer[4];
+    if(pread(fd, trailer, 4, st.st_size - 4) != 4) {
+        close(fd);
+        return NULL;
+    }
+    *size = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((unsigned int)trailer[3] << 24);
+    unsigned char *data = *size < 16 ? MAP_FAILED : mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(data == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    // gzcloseがfdも閉じる
+    gzFile gz = gzdopen(fd, "rb");
+    if(gz == NULL) {
+        close(fd);
+        munmap(data, *size);
+        return NULL;
+    }
+    // ISIZEは展開後の大きさの下位32ビットでしかないので、その後にデータが残っていないことも確かめる
+    unsigned char extra;
+    bool complete = gzread(gz, data, *size) == (int)*size && gzread(gz, &extra, 1) == 0;
+    gzclose(gz);
+    if(complete == false) {
+        munmap(data, *size);
+        return NULL;
+    }
+    mprotect(data, *size, PROT_READ);
+    return data;
+}
+
+// NES 2.0のPRG/CHR-ROMの大きさ
+// 上位4ビットが0xfの場合は、下位バイトが指数と乗数 (2^E * (M * 2 + 1))
+// 指数は63まで書けるので64ビットで計算し、4GB以上はファイルに収まらない大きさとして1 << 32を返す
+unsigned long long nes2_rom_size(unsigned char lsb, unsigned char msb, unsigned int unit) {
+    if(msb == 0x0f) {
+        if((lsb >> 2) >= 32) {
+            return 1ULL << 32;
+        }
+        return (1ULL << (lsb >> 2)) * ((lsb & 0x03) * 2 + 1);
+    }
+    return (unsigned long long)((msb << 8) | lsb) * unit;
+}
+
+// NES 2.0のRAMの大きさ (0 => なし、それ以外は64 << shift)
+unsigned int nes2_ram_size(unsigned char shift) {
+    return shift == 0 ? 0 : 64 << shift;
+}
+
+// ヘッダが間違っているROMを、PRG-ROMとCHR-ROMのCRC32で引くデータベースで修正する
+// rom/database.txtの1行が1つのROM (#から行末まではコメント)
+//     CRC32 マッパー番号 ミラーリング(H/V/4) バッテリー(0/1)
+//     1a2b3c4d 4 V 1
+// library.cは索引を作り直すたびに1回だけ読み込み、すべてのROMで同じ表を引く
+
+int compare_header_correction(const void *a, const void *b) {
+    const Header_Correction *x = a, *y = b;
+    if(x->crc != y->crc) {
+        return x->crc < y->crc ? -1 : 1;
+    }
+    return x->line - y->line;
+}
+
+// bsearch用 (keyはCRC32)
+int find_header_correction(const void *key, const void *entry) {
+    unsigned int crc = *(const unsigned int*)key;
+    const Header_Correction *e = entry;
+    return crc < e->crc ? -1 : crc > e->crc;
+}
+
+// ファイルがない場合は空のデータベースを返す
+Header_Database *load_header_database(void) {
+    Header_Database *database = calloc(1, sizeof(Header_Database));
+    FILE *fp = fopen(ROM_DATABASE, "r");
+    if(fp == NULL) {
+        return database;
+    }
+    int capacity = 0;
+    char line[256];
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        unsigned int crc, mapper;
+        char mirroring;
+        int battery;
+        if(line[0] == '#' || sscanf(line, "%x %u %c %d", &crc, &mapper, &mirroring, &battery) != 4) {
+            continue;
+        }
+        if(database->count == capacity) {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+            database->entry = realloc(database->entry, sizeof(Header_Correction) * capacity);
+        }
+        Header_Correction *e = database->entry + database->count++;
+        e->crc = crc;
+        e->mapper = mapper;
+        e->mirroring = mirroring == '4' ? MIRROR_FOUR_SCREEN : mirroring == 'V' ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+        e->has_battery = battery != 0;
+        e->line = database->count - 1;
+    }
     fclose(fp);
+    qsort(database->entry, database->count, sizeof(Header_Correction), compare_header_correction);
+    // 同じCRC32の行は最初の行だけ残す
+    int count = 0;
+    for(int i = 0; i < database->count; i++) {
+        if(count == 0 || database->entry[count - 1].crc != database->entry[i].crc) {
+            database->entry[count++] = database->entry[i];
+        }
+    }
+    database->count = count;
+    return database;
+}
+
+void free_header_database(Header_Database *database) {
+    free(database->entry);
+    free(database);
+}
 
-    if(rom->rom[0] != 'N' || rom->rom[1] != 'E' || rom->rom[2] != 'S' || rom->rom[3] != 0x1a) {
-        error("Cannot find iNES signature\n");
+// crcは呼び出し側で計算済みのPRG-ROMとCHR-ROMのCRC32
+void correct_header(ROM *rom, Header_Database *database, unsigned int crc) {
+    Header_Correction *e = bsearch(&crc, database->entry, database->count, sizeof(Header_Correction), find_header_correction);
+    if(e == NULL) {
+        return;
     }
-    rom->program_rom = rom->rom + 16 + (((rom->rom[6] & 0x04) != 0) ? 512 : 0);
-    rom->program_rom_size = 1024 * 16 * rom->rom[4];
+    rom->mapper = e->mapper;
+    rom->mirroring = e->mirroring;
+    rom->has_battery = e->has_battery;
+}
+
+// rom->romのヘッダを読み、PRG/CHRの位置と大きさ、マッパー、ミラーリングを設定する
+// ヘッダが不正な場合はエラーメッセージを返す
+char *parse_header(ROM *rom) {
+    unsigned char *header = rom->rom;
+    if(header[0] != 'N' || header[1] != 'E' || header[2] != 'S' || header[3] != 0x1a) {
+        return "Cannot find iNES signature\n";
+    }
+    rom->mapper = header[6] >> 4;
+    rom->submapper = 0;
+    unsigned long long program_rom_size, character_rom_size;
+    if((header[7] & 0x0c) == 0x08) {
+        // NES 2.0
+        rom->mapper |= (header[7] & 0xf0) | ((header[8] & 0x0f) << 8);
+        rom->submapper = header[8] >> 4;
+        program_rom_size = nes2_rom_size(header[4], header[9] & 0x0f, 0x4000);
+        character_rom_size = nes2_rom_size(header[5], header[9] >> 4, 0x2000);
+        rom->program_ram_size = nes2_ram_size(header[10] & 0x0f) + nes2_ram_size(header[10] >> 4);
+        rom->character_ram_size = nes2_ram_size(header[11] & 0x0f) + nes2_ram_size(header[11] >> 4);
+    } else {
+        // バイト12-15にゴミ("DiskDude!"など)が書かれたヘッダは、バイト7も信用しない
+        if((header[12] | header[13] | header[14] | header[15]) == 0) {
+            rom->mapper |= header[7] & 0xf0;
+        }
+        program_rom_size = 1024 * 16 * header[4];
+        character_rom_size = 1024 * 8 * header[5];
+        rom->program_ram_size = 0x2000;
+        rom->character_ram_size = 0x2000;
+    }
+    // 8KB(PRG)、1KB(CHR)単位でない大きさはページテーブルに割り当てられない
+    if(program_rom_size == 0 || program_rom_size % PRG_WINDOW_SIZE != 0 || character_rom_size % PAGE_SIZE != 0) {
+        return "Invalid ROM size\n";
+    }
+    // ポインタを作る前に、ファイルに収まることを64ビットで確かめる
+    unsigned int offset = 16 + (((header[6] & 0x04) != 0) ? 512 : 0);
+    if(offset + program_rom_size + character_rom_size > rom->rom_size) {
+        return "Invalid ROM size\n";
+    }
+    rom->program_rom_size = program_rom_size;
+    rom->character_rom_size = character_rom_size;
+    rom->program_rom = rom->rom + offset;
     rom->character_rom = rom->program_rom + rom->program_rom_size;
-    rom->character_rom_size = 1024 * 8 * rom->rom[5];
     rom->has_character_ram = rom->character_rom_size == 0;
-    rom->mirroring = (rom->rom[6] & 0x01) + ((rom->rom[6] & 0x08) >> 2);
-    rom->mapper = (rom->rom[6] >> 4) + (rom->rom[7] & 0xf0);
+    rom->has_battery = (header[6] & 0x02) != 0;
+    rom->mirroring = (header[6] & 0x08) ? MIRROR_FOUR_SCREEN : (header[6] & 0x01);
+    return NULL;
+}
+
+bool is_supported_mapper(unsigned int number) {
+    for(int i = 0; i < sizeof(mapper) / sizeof(Mapper); i++) {
+        if(mapper[i].number == number) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// バッテリーバックアップされたPRG-RAMを、ROMの拡張子(.nes、.nes.gz)を.savに替えたファイルに割り当てる
+// 書き込みはメモリへの書き込みだけで、ファイルへの反映はsync_save_fileでまとめて行う
+unsigned char *map_save_file(char *file_name, unsigned int size) {
+    char save_file[4096];
+    snprintf(save_file, sizeof(save_file) - 4, "%s", file_name);
+    size_t length = strlen(save_file);
+    if(length > 3 && strcasecmp(save_file + length - 3, ".gz") == 0) {
+        length -= 3;
+    }
+    if(length > 4 && strcasecmp(save_file + length - 4, ".nes") == 0) {
+        length -= 4;
+    }
+    strcpy(save_file + length, ".sav");
+
+    int fd = open(save_file, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || (st.st_size < size && ftruncate(fd, size) != 0)) {
+        fprintf(stderr, "Cannot open %s\n", save_file);
+        if(fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    unsigned char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+// フレームの終わりに呼ぶ (書き込まれたページの書き出しを開始するだけで、完了は待たない)
+void sync_save_file(void) {
+    if(rom != NULL && rom->has_save_file) {
+        msync(rom->program_ram, rom->program_ram_size, MS_ASYNC);
+    }
+}
+
+void sync_save_file_at_exit(void) {
+    if(rom != NULL && rom->has_save_file) {
+        msync(rom->program_ram, rom->program_ram_size, MS_SYNC);
+    }
+}
+
+ROM *load_rom(char *file_name) {
+    ROM *rom = malloc(sizeof(ROM));
+    rom->rom = map_rom_file(file_name, &rom->rom_size);
+    if(rom->rom == NULL) {
+        error("Cannot open %s\n", file_name);
+    }
+    char *message = parse_header(rom);
+    if(message != NULL) {
+        error(message);
+    }
+    Header_Database *database = load_header_database();
+    correct_header(rom, database, crc32(0, rom->program_rom, rom->program_rom_size + rom->character_rom_size));
+    free_header_database(database);
 
     if(rom->has_character_ram) {
-        static unsigned char character_ram[1024 * 8];
-        rom->character_rom = character_ram;
-    }
-
-    if(rom->mapper == 0) {
-        init_bank = mapper0_init_bank;
-        read_bank1 = mapper0_read_low_bank;
-        read_bank2 = mapper0_read_high_bank;
-        write_bank = mapper0_write_bank;
-    } else if(rom->mapper == 2) {
-        init_bank = mapper2_init_bank;
-        read_bank1 = mapper2_read_low_bank;
-        read_bank2 = mapper2_read_high_bank;
-        write_bank = mapper2_write_bank;
-    } else {
+        if(rom->character_ram_size < 0x2000) {
+            rom->character_ram_size = 0x2000;
+        }
+        rom->character_rom = calloc(1, rom->character_ram_size);
+        rom->character_rom_size = rom->character_ram_size;
+    }
+    // 0x6000-0x7fffのPRG-RAM (ワークRAM、バッテリーバックアップされている場合は.savファイル)
+    if(rom->program_ram_size < 0x2000) {
+        rom->program_ram_size = 0x2000;
+    }
+    rom->program_ram = NULL;
+    if(rom->has_battery) {
+        rom->program_ram = map_save_file(file_name, rom->program_ram_size);
+    }
+    rom->has_save_file = rom->program_ram != NULL;
+    if(rom->has_save_file == false) {
+        rom->program_ram = calloc(1, rom->program_ram_size);
+    }
+    static bool registered;
+    if(registered == false) {
+        atexit(sync_save_file_at_exit);
+        registered = true;
+    }
+
+    init_bank = NULL;
+    for(int i = 0; i < sizeof(mapper) / sizeof(Mapper); i++) {
+        if(mapper[i].number == rom->mapper) {
+            init_bank = mapper[i].init_bank;
+            write_bank = mapper[i].write_bank;
+        }
+    }
+    if(init_bank == NULL) {
         error("Unsupported mapper %d\n", rom->mapper);
     }
 
     return rom;
 }
+
+void free_rom(ROM *rom) {
+    munmap(rom->rom, rom->rom_size);
+    if(rom->has_character_ram) {
+        free(rom->character_rom);
+    }
+    if(rom->has_save_file) {
+        msync(rom->program_ram, rom->program_ram_size, MS_SYNC);
+        munmap(rom->program_ram, rom->program_ram_size);
+    } else {
+        free(rom->program_ram);
+    }
+    free(rom);
+}
+
+// ./memu --bench-mapper
+// 256KBのPRG-ROMと128KBのCHR-ROMを持つROMを合成し、バンク切り替えのレジスタへの書き込みとPRG-ROMの読み込みを1回ずつ行う繰り返しの速度をマッパーごとに表示する
+// MMC1は5回の書き込み、MMC3はバンク選択とバンクデータの2回の書き込みで1回の切り替えになる
+
+#define MAPPER_BENCH_ITERATION (10000000)
+
+void bench_switch_bank(unsigned int number, unsigned int i) {
+    switch(number) {
+        case 1:
+            for(int bit = 0; bit < 5; bit++) {
+                // 連続するサイクルの書き込みは無視されるので、STA命令の間隔だけ進める
+                cpu_cycle += 4;
+                write_bank(0xe000, (i >> bit) & 0x01);
+            }
+            break;
+        case 4:
+            write_bank(0x8000, 6);
+            write_bank(0x8001, i);
+            break;
+        default:
+            write_bank(0x8000, i);
+            break;
+    }
+}
+
+void bench_mapper(void) {
+    unsigned int program_rom_size = 0x40000, character_rom_size = 0x20000;
+    for(int m = 0; m < sizeof(mapper) / sizeof(Mapper); m++) {
+        rom = calloc(1, sizeof(ROM));
+        rom->rom_size = 16 + program_rom_size + character_rom_size;
+        rom->rom = calloc(1, rom->rom_size);
+        memcpy(rom->rom, "NES\x1a", 4);
+        rom->rom[4] = program_rom_size / 0x4000;
+        rom->rom[5] = character_rom_size / 0x2000;
+        rom->rom[6] = (mapper[m].number & 0x0f) << 4;
+        rom->rom[7] = mapper[m].number & 0xf0;
+        parse_header(rom);
+        // 8KBのバンクごとにバンク番号で埋める
+        for(unsigned int i = 0; i < program_rom_size; i++) {
+            rom->program_rom[i] = i / 0x2000;
+        }
+        rom->program_ram = calloc(1, rom->program_ram_size);
+        init_bank = mapper[m].init_bank;
+        write_bank = mapper[m].write_bank;
+        init_event();
+        init_memory_map();
+        init_ppu();
+        init_bank();
+
+        unsigned int sum = 0;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(unsigned int i = 0; i < MAPPER_BENCH_ITERATION; i++) {
+            bench_switch_bank(mapper[m].number, i);
+            sum += read8(0x8000 + (i & 0x7fff));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double second = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("mapper %u: %.1fM/s (%u)\n", mapper[m].number, MAPPER_BENCH_ITERATION / second / 1e6, sum);
+
+        free(rom->program_ram);
+        free(rom->rom);
+        free(rom);
+        rom = NULL;
+    }
+}
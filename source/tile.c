@@ -0,0 +1,217 @@
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// デコード済みタイルのキャッシュ
+// パターンテーブルの8*8タイル(2つのビットプレーンの16バイト)を、1ピクセル1バイトの色番号(0-3)に展開して保持する
+// - キーはCHR-ROM(CHR-RAM)上の位置なので、CHRバンクを切り替えても展開済みのタイルはそのまま使える
+// - 水平反転したものも同時に展開する
+// - CHR-RAMへの書き込みでは、書き込まれたタイルだけを無効にする
+// タイルの展開と、色番号からパレットの値への変換(合成)はSIMDのカーネルで行う
+// - AVX2、SSE2、スカラーのどれを使うかは最初のinit_tile_cacheでCPUIDを見て選ぶ
+
+// フレームごとに展開したタイル数を標準エラー出力に表示する
+// #define TILE_CACHE_STATS
+
+extern ROM *rom;
+
+// [タイル][0 => 通常, 1 => 水平反転]
+Decoded_Tile (*decoded_tile)[2];
+bool *decoded_tile_valid;
+unsigned int decoded_tile_count;
+// 現在のフレームと、直前のフレームで展開したタイル数
+unsigned int tile_decode_count;
+unsigned int frame_tile_decode_count;
+
+// タイルの展開
+// 各ビットを色番号のビット0(low)とビット1(high)に分ける (水平反転はビットの並びを逆に読む)
+
+void decode_tile_scalar(unsigned char *normal, unsigned char *flipped, unsigned char *pattern) {
+    for(int y = 0; y < 8; y++) {
+        unsigned char low = pattern[y];
+        unsigned char high = pattern[y + 8];
+        for(int x = 0; x < 8; x++) {
+            unsigned char color_index = ((low >> (7 - x)) & 1) + ((high >> (7 - x)) & 1) * 2;
+            normal[8 * y + x] = color_index;
+            flipped[8 * y + 7 - x] = color_index;
+        }
+    }
+}
+
+// 合成
+// compose_line: 背景の1行 (indexはパレット番号 * 4 + 色番号、paletteは背景の16色)
+// compose_sprite_row: スプライトの8ピクセルのうち、maskのビットがセットされたもの (countは画面内のピクセル数)
+
+void compose_line_scalar(unsigned char *out, unsigned char *index, unsigned char *palette) {
+    for(int x = 0; x < SCREEN_BLOCK_WIDTH; x++) {
+        out[x] = palette[index[x]];
+    }
+}
+
+void compose_sprite_row_scalar(unsigned char *out, unsigned char *pixel, unsigned char *palette, unsigned int mask, int count) {
+    for(int x = 0; x < count; x++) {
+        if(mask & (1 << x)) {
+            out[x] = palette[pixel[x]];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// 2行(16ピクセル)ずつ、各バイトを8回並べてビットのマスクと比較する
+void decode_tile_sse2(unsigned char *normal, unsigned char *flipped, unsigned char *pattern) {
+    __m128i bit = _mm_setr_epi8(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01, 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    __m128i reversed_bit = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80);
+    __m128i one = _mm_set1_epi8(1);
+    __m128i two = _mm_set1_epi8(2);
+    for(int y = 0; y < 8; y += 2) {
+        __m128i low = _mm_unpacklo_epi64(_mm_set1_epi8(pattern[y]), _mm_set1_epi8(pattern[y + 1]));
+        __m128i high = _mm_unpacklo_epi64(_mm_set1_epi8(pattern[y + 8]), _mm_set1_epi8(pattern[y + 9]));
+        __m128i n = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(low, bit), bit), one),
+                                 _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(high, bit), bit), two));
+        __m128i f = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(low, reversed_bit), reversed_bit), one),
+                                 _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(high, reversed_bit), reversed_bit), two));
+        _mm_storeu_si128((__m128i*)(normal + 8 * y), n);
+        _mm_storeu_si128((__m128i*)(flipped + 8 * y), f);
+    }
+}
+
+// maskのビットを各レーンに広げ、セットされたレーンだけを書き換える
+void compose_sprite_row_sse2(unsigned char *out, unsigned char *pixel, unsigned char *palette, unsigned int mask, int count) {
+    // 右端で切れる場合は画面の外を読み書きしないようにスカラーで処理する
+    if(count < 8) {
+        compose_sprite_row_scalar(out, pixel, palette, mask, count);
+        return;
+    }
+    __m128i i = _mm_loadl_epi64((__m128i*)pixel);
+    __m128i bit = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i write = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(mask), bit), bit);
+    __m128i color = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(i, _mm_set1_epi8(1)), _mm_set1_epi8(palette[1])),
+                                              _mm_and_si128(_mm_cmpeq_epi8(i, _mm_set1_epi8(2)), _mm_set1_epi8(palette[2]))),
+                                 _mm_and_si128(_mm_cmpeq_epi8(i, _mm_set1_epi8(3)), _mm_set1_epi8(palette[3])));
+    __m128i o = _mm_loadl_epi64((__m128i*)out);
+    _mm_storel_epi64((__m128i*)out, _mm_or_si128(_mm_and_si128(write, color), _mm_andnot_si128(write, o)));
+}
+
+// 4行(32ピクセル)ずつ、pshufbで各行のバイトを8回並べる
+__attribute__((target("avx2"))) void decode_tile_avx2(unsigned char *normal, unsigned char *flipped, unsigned char *pattern) {
+    __m256i bit = _mm256_set1_epi64x(0x0102040810204080ULL);
+    __m256i reversed_bit = _mm256_set1_epi64x(0x8040201008040201ULL);
+    __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    __m256i one = _mm256_set1_epi8(1);
+    __m256i two = _mm256_set1_epi8(2);
+    for(int y = 0; y < 8; y += 4) {
+        int low_rows, high_rows;
+        memcpy(&low_rows, pattern + y, 4);
+        memcpy(&high_rows, pattern + y + 8, 4);
+        __m256i low = _mm256_shuffle_epi8(_mm256_set1_epi32(low_rows), spread);
+        __m256i high = _mm256_shuffle_epi8(_mm256_set1_epi32(high_rows), spread);
+        __m256i n = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(low, bit), bit), one),
+                                    _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(high, bit), bit), two));
+        __m256i f = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(low, reversed_bit), reversed_bit), one),
+                                    _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(high, reversed_bit), reversed_bit), two));
+        _mm256_storeu_si256((__m256i*)(normal + 8 * y), n);
+        _mm256_storeu_si256((__m256i*)(flipped + 8 * y), f);
+    }
+}
+
+// 16色の表を両方のレーンに置き、pshufbで32ピクセルずつ引く
+__attribute__((target("avx2"))) void compose_line_avx2(unsigned char *out, unsigned char *index, unsigned char *palette) {
+    __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)palette));
+    for(int x = 0; x < SCREEN_BLOCK_WIDTH; x += 32) {
+        __m256i i = _mm256_loadu_si256((__m256i*)(index + x));
+        _mm256_storeu_si256((__m256i*)(out + x), _mm256_shuffle_epi8(table, i));
+    }
+}
+
+__attribute__((target("avx2"))) void compose_sprite_row_avx2(unsigned char *out, unsigned char *pixel, unsigned char *palette, unsigned int mask, int count) {
+    if(count < 8) {
+        compose_sprite_row_scalar(out, pixel, palette, mask, count);
+        return;
+    }
+    __m128i i = _mm_loadl_epi64((__m128i*)pixel);
+    __m128i bit = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i write = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(mask), bit), bit);
+    int table;
+    memcpy(&table, palette, 4);
+    __m128i color = _mm_shuffle_epi8(_mm_cvtsi32_si128(table), i);
+    _mm_storel_epi64((__m128i*)out, _mm_blendv_epi8(_mm_loadl_epi64((__m128i*)out), color, write));
+}
+#endif
+
+void (*decode_tile_kernel)(unsigned char *normal, unsigned char *flipped, unsigned char *pattern);
+void (*compose_line)(unsigned char *out, unsigned char *index, unsigned char *palette);
+void (*compose_sprite_row)(unsigned char *out, unsigned char *pixel, unsigned char *palette, unsigned int mask, int count);
+
+void select_tile_kernel(void) {
+    decode_tile_kernel = decode_tile_scalar;
+    compose_line = compose_line_scalar;
+    compose_sprite_row = compose_sprite_row_scalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        decode_tile_kernel = decode_tile_avx2;
+        compose_line = compose_line_avx2;
+        compose_sprite_row = compose_sprite_row_avx2;
+    } else {
+        // SSE2にはバイト単位の表引き(pshufb)がなく、16色と比較して選ぶ方法はスカラーの表引きより遅かったので、compose_lineはスカラーのまま
+        decode_tile_kernel = decode_tile_sse2;
+        compose_sprite_row = compose_sprite_row_sse2;
+    }
+#endif
+}
+
+// ROMの読み込み時に呼ぶ
+void init_tile_cache(void) {
+    if(decode_tile_kernel == NULL) {
+        select_tile_kernel();
+    }
+    free(decoded_tile);
+    free(decoded_tile_valid);
+    decoded_tile_count = rom->character_rom_size / 16;
+    decoded_tile = malloc(sizeof(*decoded_tile) * decoded_tile_count);
+    decoded_tile_valid = calloc(decoded_tile_count, sizeof(bool));
+    if(decoded_tile == NULL || decoded_tile_valid == NULL) {
+        error("Cannot allocate tile cache\n");
+    }
+    tile_decode_count = frame_tile_decode_count = 0;
+}
+
+// patternはタイルの先頭 (ppu_pointerで得たCHR-ROM(CHR-RAM)上のアドレス)
+Decoded_Tile *decode_tile(unsigned char *pattern, bool flip_horizontal) {
+    unsigned int index = (pattern - rom->character_rom) / 16;
+    if(decoded_tile_valid[index] == false) {
+        Decoded_Tile *tile = decoded_tile[index];
+        decode_tile_kernel(tile[0].pixel, tile[1].pixel, pattern);
+        // 水平反転したものは、ビットプレーンのビット順(ビット7が左端)を逆にしたものがそのまま不透明なピクセルになる
+        for(int y = 0; y < 8; y++) {
+            unsigned char opaque = pattern[y] | pattern[y + 8];
+            tile[1].opaque[y] = opaque;
+            opaque = ((opaque & 0xf0) >> 4) | ((opaque & 0x0f) << 4);
+            opaque = ((opaque & 0xcc) >> 2) | ((opaque & 0x33) << 2);
+            tile[0].opaque[y] = ((opaque & 0xaa) >> 1) | ((opaque & 0x55) << 1);
+        }
+        decoded_tile_valid[index] = true;
+        tile_decode_count += 1;
+    }
+    return &decoded_tile[index][flip_horizontal];
+}
+
+// CHR-RAMのaddressに書き込んだ場合に呼ぶ
+void invalidate_tile(unsigned char *address) {
+    decoded_tile_valid[(address - rom->character_rom) / 16] = false;
+}
+
+// フレームの描画が終わった時に呼ぶ
+void finish_tile_frame(void) {
+    frame_tile_decode_count = tile_decode_count;
+    tile_decode_count = 0;
+#ifdef TILE_CACHE_STATS
+    if(frame_tile_decode_count > 0) {
+        fprintf(stderr, "%u tiles decoded\n", frame_tile_decode_count);
+    }
+#endif
+}
@@ -0,0 +1,116 @@
+#include "common.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// SIMDの並べ替えは3倍の拡大専用
+#if defined(__x86_64__) && BLOCK_PIXEL_SIZE == 3
+#define SIMD_SCALE
+#endif
+
+// 画面出力
+// PPUがscreenに書いた256*240の色番号を、表示するフレームごとに1回だけRGBに変換してBLOCK_PIXEL_SIZE倍に拡大し、frameに書き込む
+// - 1行を色番号からRGBに変換しながら横に拡大し、縦の残りの行はその行のコピーにする
+// - 横の拡大はAVX2(8ピクセルずつ)かSSE2(4ピクセルずつ)で行い、実行時にCPUIDで選ぶ (x86-64以外と、3倍以外の拡大はスカラー)
+
+extern unsigned char screen[SCREEN_BLOCK_WIDTH * SCREEN_BLOCK_HEIGHT];
+extern unsigned char frame[BYTE_PER_PIXEL * SCREEN_PIXEL_WIDTH * SCREEN_PIXEL_HEIGHT];
+extern unsigned int frame_count;
+
+// NESの色番号ごとのBGR
+unsigned char color[64 * 3] = {
+    0x80, 0x80, 0x80, 0xA6, 0x3D, 0x00, 0xB0, 0x12, 0x00, 0x96, 0x00, 0x44, 0x5E, 0x00, 0xA1,
+    0x28, 0x00, 0xC7, 0x00, 0x06, 0xBA, 0x00, 0x17, 0x8C, 0x00, 0x2F, 0x5C, 0x00, 0x45, 0x10,
+    0x00, 0x4A, 0x05, 0x2E, 0x47, 0x00, 0x66, 0x41, 0x00, 0x00, 0x00, 0x00, 0x05, 0x05, 0x05,
+    0x05, 0x05, 0x05, 0xC7, 0xC7, 0xC7, 0xFF, 0x77, 0x00, 0xFF, 0x55, 0x21, 0xFA, 0x37, 0x82,
+    0xB5, 0x2F, 0xEB, 0x50, 0x29, 0xFF, 0x00, 0x22, 0xFF, 0x00, 0x32, 0xD6, 0x00, 0x62, 0xC4,
+    0x00, 0x80, 0x35, 0x00, 0x8F, 0x05, 0x55, 0x8A, 0x00, 0xCC, 0x99, 0x00, 0x21, 0x21, 0x21,
+    0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xD7, 0x0F, 0xFF, 0xA2, 0x69,
+    0xFF, 0x80, 0xD4, 0xF3, 0x45, 0xFF, 0x8B, 0x61, 0xFF, 0x33, 0x88, 0xFF, 0x12, 0x9C, 0xFF,
+    0x20, 0xBC, 0xFA, 0x0E, 0xE3, 0x9F, 0x35, 0xF0, 0x2B, 0xA4, 0xF0, 0x0C, 0xFF, 0xFB, 0x05,
+    0x5E, 0x5E, 0x5E, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFC, 0xA6,
+    0xFF, 0xEC, 0xB3, 0xEB, 0xAB, 0xDA, 0xF9, 0xA8, 0xFF, 0xB3, 0xAB, 0xFF, 0xB0, 0xD2, 0xFF,
+    0xA6, 0xEF, 0xFF, 0x9C, 0xF7, 0xFF, 0x95, 0xE8, 0xD7, 0xAF, 0xED, 0xA6, 0xDA, 0xF2, 0xA2,
+    0xFC, 0xFF, 0x99, 0xDD, 0xDD, 0xDD, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11
+};
+
+// cairoのRGB24形式の色 (パレットの上位2ビットは無視されるので、256個の値すべてに色番号の下位6ビットの色を入れる)
+unsigned int rgb_table[256];
+// 最後にframeに変換したフレーム
+unsigned int presented_frame_count = -1;
+
+void init_rgb_table(void) {
+    for(int i = 0; i < 256; i++) {
+        unsigned char *c = color + 3 * (i & 0x3f);
+        rgb_table[i] = c[0] | (c[1] << 8) | (c[2] << 16);
+    }
+}
+
+void scale_line_scalar(unsigned int *out, unsigned char *in) {
+    for(int x = 0; x < SCREEN_BLOCK_WIDTH; x++) {
+        unsigned int rgb = rgb_table[in[x]];
+        for(int i = 0; i < BLOCK_PIXEL_SIZE; i++) {
+            *out++ = rgb;
+        }
+    }
+}
+
+#if defined(SIMD_SCALE)
+// 4ピクセル(a b c d)を、aaab bbcc cddd の3つに並べ替えて書き込む
+void scale_line_sse2(unsigned int *out, unsigned char *in) {
+    for(int x = 0; x < SCREEN_BLOCK_WIDTH; x += 4, out += 12) {
+        __m128i p = _mm_setr_epi32(rgb_table[in[x]], rgb_table[in[x + 1]], rgb_table[in[x + 2]], rgb_table[in[x + 3]]);
+        _mm_storeu_si128((__m128i*)(out + 0), _mm_shuffle_epi32(p, _MM_SHUFFLE(1, 0, 0, 0)));
+        _mm_storeu_si128((__m128i*)(out + 4), _mm_shuffle_epi32(p, _MM_SHUFFLE(2, 2, 1, 1)));
+        _mm_storeu_si128((__m128i*)(out + 8), _mm_shuffle_epi32(p, _MM_SHUFFLE(3, 3, 3, 2)));
+    }
+}
+
+// 8ピクセルの色をgatherで引き、3つの並べ替えで24ピクセルにする
+__attribute__((target("avx2"))) void scale_line_avx2(unsigned int *out, unsigned char *in) {
+    __m256i first = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+    __m256i second = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+    __m256i third = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+    for(int x = 0; x < SCREEN_BLOCK_WIDTH; x += 8, out += 24) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(in + x)));
+        __m256i p = _mm256_i32gather_epi32((int*)rgb_table, index, 4);
+        _mm256_storeu_si256((__m256i*)(out + 0), _mm256_permutevar8x32_epi32(p, first));
+        _mm256_storeu_si256((__m256i*)(out + 8), _mm256_permutevar8x32_epi32(p, second));
+        _mm256_storeu_si256((__m256i*)(out + 16), _mm256_permutevar8x32_epi32(p, third));
+    }
+}
+#endif
+
+void (*select_scale_line(void))(unsigned int *out, unsigned char *in) {
+#if defined(SIMD_SCALE)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        return scale_line_avx2;
+    }
+    return scale_line_sse2;
+#else
+    return scale_line_scalar;
+#endif
+}
+
+// 描画されたscreenをframeに変換する (drawから呼ぶ、前回から新しいフレームが描画されていない場合は何もしない)
+void present_frame(void) {
+    static void (*scale_line)(unsigned int *out, unsigned char *in);
+    if(scale_line == NULL) {
+        init_rgb_table();
+        scale_line = select_scale_line();
+    }
+    if(presented_frame_count == frame_count) {
+        return;
+    }
+    presented_frame_count = frame_count;
+    unsigned int *out = (unsigned int*)frame;
+    for(int y = 0; y < SCREEN_BLOCK_HEIGHT; y++) {
+        scale_line(out, screen + SCREEN_BLOCK_WIDTH * y);
+        for(int i = 1; i < BLOCK_PIXEL_SIZE; i++) {
+            memcpy(out + SCREEN_PIXEL_WIDTH * i, out, sizeof(unsigned int) * SCREEN_PIXEL_WIDTH);
+        }
+        out += BLOCK_PIXEL_SIZE * SCREEN_PIXEL_WIDTH;
+    }
+}